@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include "chat_registry.h"
+
+#define INITIAL_SLOTS 16
+
+static unsigned hash_uid(int uid)
+{
+    return (unsigned)uid * 2654435761u;
+}
+
+// Index of uid's entry in the hash, or of the empty entry where it belongs
+static unsigned index_find(const registry_t *r, int uid)
+{
+    unsigned i = hash_uid(uid) & r->index_mask;
+    while (r->index[i] && r->slots[r->index[i] - 1].uid != uid)
+        i = (i + 1) & r->index_mask;
+    return i;
+}
+
+int registry_init(registry_t *r)
+{
+    r->slot_cap = INITIAL_SLOTS;
+    r->slots = malloc(r->slot_cap * sizeof(registry_slot_t));
+    r->dense = malloc(r->slot_cap * sizeof(int));
+    // Twice the slots, so the hash is never more than half full
+    r->index = calloc(2 * r->slot_cap, sizeof(int));
+    r->index_mask = 2 * r->slot_cap - 1;
+    r->count = 0;
+    if (!r->slots || !r->dense || !r->index)
+        return -1;
+
+    for (int i = 0; i < r->slot_cap; i++)
+        r->slots[i].pos = i + 1 < r->slot_cap ? i + 1 : -1;
+    r->free_slot = 0;
+    return 0;
+}
+
+// Doubles the slots, the dense array and the hash
+static int registry_grow(registry_t *r)
+{
+    int cap = 2 * r->slot_cap;
+    registry_slot_t *slots = realloc(r->slots, cap * sizeof(registry_slot_t));
+    if (!slots)
+        return -1;
+    r->slots = slots;
+    int *dense = realloc(r->dense, cap * sizeof(int));
+    if (!dense)
+        return -1;
+    r->dense = dense;
+    int *index = calloc(2 * cap, sizeof(int));
+    if (!index)
+        return -1;
+
+    free(r->index);
+    r->index = index;
+    r->index_mask = 2 * cap - 1;
+    for (int i = 0; i < r->count; i++)
+    {
+        int slot = r->dense[i];
+        r->index[index_find(r, r->slots[slot].uid)] = slot + 1;
+    }
+
+    // Every slot was in use, the new ones make up the free list
+    for (int i = r->slot_cap; i < cap; i++)
+        r->slots[i].pos = i + 1 < cap ? i + 1 : -1;
+    r->free_slot = r->slot_cap;
+    r->slot_cap = cap;
+    return 0;
+}
+
+int registry_add(registry_t *r, int uid, void *client)
+{
+    if (r->free_slot < 0 && registry_grow(r) < 0)
+        return -1;
+
+    int slot = r->free_slot;
+    r->free_slot = r->slots[slot].pos;
+    r->slots[slot].uid = uid;
+    r->slots[slot].client = client;
+    r->slots[slot].pos = r->count;
+    r->dense[r->count++] = slot;
+    r->index[index_find(r, uid)] = slot + 1;
+    return slot;
+}
+
+void *registry_find(registry_t *r, int uid)
+{
+    unsigned i = index_find(r, uid);
+    return r->index[i] ? r->slots[r->index[i] - 1].client : NULL;
+}
+
+void *registry_remove(registry_t *r, int uid)
+{
+    unsigned i = index_find(r, uid);
+    if (!r->index[i])
+        return NULL;
+    int slot = r->index[i] - 1;
+    void *client = r->slots[slot].client;
+
+    // Linear probing without tombstones: move later entries of the run
+    // back into the hole when their home is not between it and them
+    unsigned hole = i;
+    unsigned j = (i + 1) & r->index_mask;
+    while (r->index[j])
+    {
+        unsigned home = hash_uid(r->slots[r->index[j] - 1].uid) & r->index_mask;
+        if (((j - home) & r->index_mask) >= ((j - hole) & r->index_mask))
+        {
+            r->index[hole] = r->index[j];
+            hole = j;
+        }
+        j = (j + 1) & r->index_mask;
+    }
+    r->index[hole] = 0;
+
+    // The last of the dense array fills the gap
+    int pos = r->slots[slot].pos;
+    int last = r->dense[--r->count];
+    r->dense[pos] = last;
+    r->slots[last].pos = pos;
+
+    r->slots[slot].client = NULL;
+    r->slots[slot].pos = r->free_slot;
+    r->free_slot = slot;
+    return client;
+}
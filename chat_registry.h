@@ -0,0 +1,47 @@
+#ifndef CHAT_REGISTRY_H
+#define CHAT_REGISTRY_H
+
+// The connected clients of a chat server, by uid. Clients live in slots
+// that are reused through a free list; a hash finds a uid's slot, and a
+// dense array of the slots in use is what broadcasts walk. Adding, finding
+// and removing are O(1), and the tables grow as needed.
+//
+// There is no locking: a threaded server holds its own mutex around calls.
+
+typedef struct
+{
+    int uid;
+    int pos;  // in the dense array; the next free slot while free
+    void *client;
+} registry_slot_t;
+
+typedef struct
+{
+    registry_slot_t *slots;
+    int slot_cap;
+    int free_slot; // head of the free list, -1 if empty
+    int *dense;    // slots in use, in no particular order
+    int count;
+    int *index;    // open addressing, uid -> slot + 1, 0 if empty
+    unsigned index_mask;
+} registry_t;
+
+int registry_init(registry_t *r);
+
+// Returns the slot, or -1 if memory ran out
+int registry_add(registry_t *r, int uid, void *client);
+
+void *registry_find(registry_t *r, int uid);
+
+// Returns the client removed, or NULL if uid was not there. The last client
+// of the dense array takes the place of the one removed, so a loop that
+// removes as it goes should walk backwards.
+void *registry_remove(registry_t *r, int uid);
+
+// The i-th client in use, 0 <= i < r->count
+static inline void *registry_at(const registry_t *r, int i)
+{
+    return r->slots[r->dense[i]].client;
+}
+
+#endif
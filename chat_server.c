@@ -1,363 +1,1656 @@
+#define _GNU_SOURCE // accept4, splice, O_TMPFILE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/sendfile.h>
-#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <stdint.h>
 #include <errno.h>
 #include <signal.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include "chat_registry.h"
+
+// Chat and file relay server. One thread runs an edge-triggered epoll loop
+// over non-blocking sockets: each connection has a read buffer for what
+// arrived and a queue of messages the socket has not taken yet, so no
+// client ever makes the server wait.
+//
+// A queue holds at most -q bytes. A client that falls that far behind gets
+// its oldest messages dropped, is disconnected, or holds every sender back
+// until it catches up, as -p says; the others are served as fast as they
+// read either way. SIGUSR1 prints queue depths and what the policy did.
+//
+// An upload is relayed as it arrives: it is spliced from the socket into an
+// unlinked spool file of its own (kept under its name once complete, unless
+// -k 0) and every recipient is sent what the spool holds so far with
+// sendfile, each at its own pace. Any number of files are relayed at once;
+// each client has a queue of those offered to it and takes them one after
+// the other. A v2 client gets chat in between the chunks of a file, ahead
+// of them.
+//
+// Clients speak v1, where every read is one message (protocolo.md), or
+// v2, length-prefixed frames, if the first bytes they send are V2_MAGIC.
+// Messages are relayed between the two.
 
 #define PORT 8080
 #define BUFFER_SIZE 1024
-#define MAX_CLIENTS 10
 #define DELIMITER '#'
+#define MAX_EVENTS 64
+#define DEFAULT_QUEUE_BYTES (256 * 1024)
+#define MIN_QUEUE_BYTES (4 * BUFFER_SIZE)
+#define QUEUE_SLOTS 16 // initial ring size, grows as needed
+#define FLUSH_IOVS 64  // messages per sendmsg
+#define UPLOAD_CHUNK 65536 // moved from an uploading socket at a time
+#define READ_BUDGET (4 * UPLOAD_CHUNK) // of an upload per loop pass
+
+// Protocol v2. A client opens with V2_MAGIC and a FRAME_HELLO; every frame
+// then starts with a FRAME_HEADER byte header: type (16 bits), payload
+// length (32) and sequence number (32), big-endian. A client numbers its
+// frames from 1; the server numbers everything it builds, so gaps in what
+// a client receives are messages that were not for it or were dropped.
+#define V2_MAGIC "\0CH2"
+#define V2_MAGIC_LEN 4
+#define FRAME_HEADER 10
+#define MAX_PAYLOAD 8192
+#define RING_SIZE 16384 // v2 input, a power of two above MAX_PAYLOAD + FRAME_HEADER
+
+#define FRAME_HELLO 1 // the client's name; answered with an empty one
+#define FRAME_MSG 2   // chat text
+#define FRAME_FILE 3  // "<name>#<size>": the client has a file, or is offered one
+#define FRAME_READY 4 // go ahead: to a client with a file, from one offered it
+#define FRAME_DATA 5  // from the client: the whole file, its payload streamed
+#define FRAME_EXIT 6
+#define FRAME_CHUNK 7 // the next part of a file, between other frames
+
+// The server sends files to v2 clients in chunks, the next one only while
+// less than CHUNK_LOWAT bytes wait in the socket, so that chat never queues
+// behind more than about a chunk of file
+#define CHUNK_SIZE 32768
+#define CHUNK_LOWAT 32768
 
+// Connection states
+#define CL_NAME 0   // the first message is the client's name
+#define CL_CHAT 1   // every read is a message for the others
+#define CL_UPLOAD 2 // the rest of a file announced with "file: "
+
+// What to do with a client whose queue is full
+#define SLOW_DROP 0       // drop its oldest messages
+#define SLOW_DISCONNECT 1 // close the connection
+#define SLOW_BLOCK 2      // stop reading senders until it is half empty
+
+// A message as it goes out, built once and shared by the queues of all
+// its recipients
 typedef struct
+{
+    int refs;
+    int control; // part of a handshake, never dropped
+    size_t len;
+    char data[];
+} msg_t;
+
+typedef struct
+{
+    msg_t **ring;
+    unsigned cap; // a power of two
+    unsigned head;
+    unsigned count;
+} msg_queue_t;
+
+// A file being handed out to the other clients while it is uploaded. The
+// recipients are the clients there when the upload starts; each gets the
+// offer when the files before it in its queue are through and, after
+// "ready", the file up to avail.
+typedef struct relay
+{
+    char filename[40];
+    long size;
+    long avail;    // uploaded so far
+    int fd;        // the spool
+    int uploading; // avail may still grow
+    int failed;    // the upload broke off
+    int pending;   // transfers not done yet
+    int *uids;     // recipients
+    int count;
+    char *skipped; // v2 clients left out of a file over 4 GB, "a, b", or NULL
+} relay_t;
+
+// A relay as one recipient has it queued
+typedef struct transfer
+{
+    relay_t *relay;
+    struct transfer *next;
+} transfer_t;
+
+typedef struct client
 {
     struct sockaddr_in address;
     int sockfd;
     int uid;
     char name[32];
+    int state;
+    int dead; // closed at the end of the loop iteration
+    char in[BUFFER_SIZE + 1]; // v1: one read, NUL terminated
+    int v2;
+    int magic_ok;
+    unsigned char *ring; // v2: received, not yet parsed
+    uint32_t ring_head;
+    uint32_t ring_len;
+    uint32_t in_seq;     // of the last frame from the client
+    int in_data;         // in the payload of a FRAME_DATA or FRAME_CHUNK
+    uint32_t data_left;  // of that payload
+    msg_queue_t out;    // not yet written to the socket
+    size_t out_sent;    // of the head of out, already written
+    msg_queue_t held;   // v1: messages that wait for a file on its way to it
+    size_t queued;      // bytes still to write in out and held
+    int queued_msgs;
+    size_t queued_peak;
+    int blocking;       // over the limit under SLOW_BLOCK, senders wait
+    int paused;         // a sender waiting, not read from
+    int dirty;          // on the list of clients to write to
+    struct client *dirty_next;
+    size_t read_left;   // of the upload it may still read this pass
+    int more;           // stopped with input left, on the list to read again
+    struct client *more_next;
+    relay_t *upload; // the client is uploading this relay's file
+    long file_left;
+    int pipe[2];     // splices the upload into the spool
+    transfer_t *xfer; // files for the client, the first one offered
+    transfer_t *xfer_tail;
+    int ready;        // the first one was asked for and is being sent
+    off_t file_off;
+    char chunk_hdr[FRAME_HEADER]; // v2: the FRAME_CHUNK being written
+    int chunk_hdr_left;
+    uint32_t chunk_left;
 } client_t;
 
-client_t *clients[MAX_CLIENTS];
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-void add_client(client_t *cl);
-void remove_client(int uid);
-void send_message(char *s, int uid);
-void *handle_client(void *arg);
-void receive_file(int sockfd, const char *filename, long file_size);
-void send_file(const char *filename, int uid);
-void send_file_func(int uid, const char *filename, long file_size);
+static registry_t clients;
 
 static int uid = 10;
+static int epfd;
+static int keep_uploads = 1;
+static int no_splice; // the kernel cannot splice from sockets
+
+static size_t queue_limit = DEFAULT_QUEUE_BYTES;
+static int slow_policy = SLOW_DROP;
+static int blockers;       // clients with blocking set
+static int resume_pending; // blockers went to zero, read the paused senders
+static client_t *dirty;    // clients with new output since the last flush
+static client_t *more;     // uploaders to read again on the next pass
+static uint32_t out_seq;   // of the last v2 frame built
+static unsigned long long msgs_dropped;
+static unsigned long long slow_disconnects;
+static volatile sig_atomic_t report;
+
+static void relay_check(relay_t *r);
 
 void handler(int signal)
 {
     exit(EXIT_SUCCESS);
 }
 
-int main(int argc, char *argv[])
+static void report_handler(int signal)
 {
-    signal(SIGTERM, handler);
-    // Give the IP as a parameter
-    if (argc != 2)
+    report = 1;
+}
+
+static msg_t *msg_new(const char *s, size_t len, int control)
+{
+    msg_t *m = malloc(sizeof(msg_t) + len);
+    if (!m)
+        return NULL;
+    m->refs = 1;
+    m->control = control;
+    m->len = len;
+    memcpy(m->data, s, len);
+    return m;
+}
+
+// A v2 frame, payload included
+static msg_t *frame_new(int type, const void *payload, uint32_t len, int control)
+{
+    msg_t *m = malloc(sizeof(msg_t) + FRAME_HEADER + len);
+    if (!m)
+        return NULL;
+    m->refs = 1;
+    m->control = control;
+    m->len = FRAME_HEADER + len;
+    uint16_t t = htons(type);
+    uint32_t l = htonl(len);
+    uint32_t seq = htonl(++out_seq);
+    memcpy(m->data, &t, 2);
+    memcpy(m->data + 2, &l, 4);
+    memcpy(m->data + 6, &seq, 4);
+    memcpy(m->data + FRAME_HEADER, payload, len);
+    return m;
+}
+
+static void msg_put(msg_t *m)
+{
+    if (--m->refs == 0)
+        free(m);
+}
+
+static msg_t *queue_at(const msg_queue_t *q, unsigned i)
+{
+    return q->ring[(q->head + i) & (q->cap - 1)];
+}
+
+// Adds a reference to m at the tail
+static int queue_push(msg_queue_t *q, msg_t *m)
+{
+    if (q->count == q->cap)
     {
-        fprintf(stderr, "Usage: %s <server_ip>\n", argv[0]);
-        exit(EXIT_FAILURE);
+        unsigned cap = q->cap ? 2 * q->cap : QUEUE_SLOTS;
+        msg_t **ring = malloc(cap * sizeof(msg_t *));
+        if (!ring)
+            return -1;
+        for (unsigned i = 0; i < q->count; i++)
+            ring[i] = queue_at(q, i);
+        free(q->ring);
+        q->ring = ring;
+        q->cap = cap;
+        q->head = 0;
     }
-    const char *server_ip = argv[1];
+    q->ring[(q->head + q->count++) & (q->cap - 1)] = m;
+    m->refs++;
+    return 0;
+}
 
-    int sockfd, newsockfd;
-    struct sockaddr_in server_addr, client_addr;
-    pthread_t tid;
+static void queue_pop(msg_queue_t *q)
+{
+    msg_put(q->ring[q->head]);
+    q->head = (q->head + 1) & (q->cap - 1);
+    q->count--;
+}
 
-    // Socket settings
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = inet_addr(server_ip);
-    server_addr.sin_port = htons(PORT);
+static void queue_free(msg_queue_t *q)
+{
+    while (q->count)
+        queue_pop(q);
+    free(q->ring);
+    q->ring = NULL;
+    q->cap = 0;
+}
 
-    // Bind
-    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+static void mark_dirty(client_t *cli)
+{
+    if (!cli->dirty)
     {
-        perror("ERROR: Bind failed");
-        return EXIT_FAILURE;
+        cli->dirty = 1;
+        cli->dirty_next = dirty;
+        dirty = cli;
     }
+}
 
-    // Listen
-    if (listen(sockfd, 10) < 0)
+static void xfer_offer(client_t *cli);
+
+// The first file is through for this recipient: what was held back for it
+// follows, then the offer of the next one
+static void xfer_done(client_t *cli)
+{
+    transfer_t *x = cli->xfer;
+    relay_t *r = x->relay;
+    cli->xfer = x->next;
+    if (!cli->xfer)
+        cli->xfer_tail = NULL;
+    free(x);
+    cli->ready = 0;
+    while (cli->held.count)
     {
-        perror("ERROR: Socket listen");
-        return EXIT_FAILURE;
+        if (queue_push(&cli->out, queue_at(&cli->held, 0)) < 0)
+            cli->dead = 1;
+        queue_pop(&cli->held);
     }
+    r->pending--;
+    relay_check(r);
+    if (cli->xfer)
+        xfer_offer(cli);
+}
 
-    printf("Listening on: %s:%d\n", inet_ntoa(server_addr.sin_addr), ntohs(server_addr.sin_port));
+// Writes queued messages, up to FLUSH_IOVS of them a call. Returns 1 once
+// the queue is empty, 0 if the socket is full or the client gone.
+static int flush_queue(client_t *cli)
+{
+    int drained = 1;
+    while (cli->out.count)
+    {
+        struct iovec iov[FLUSH_IOVS];
+        size_t total = 0;
+        int n_iov = 0;
+        for (unsigned i = 0; i < cli->out.count && n_iov < FLUSH_IOVS; i++)
+        {
+            msg_t *m = queue_at(&cli->out, i);
+            size_t skip = i == 0 ? cli->out_sent : 0;
+            iov[n_iov].iov_base = m->data + skip;
+            iov[n_iov].iov_len = m->len - skip;
+            total += m->len - skip;
+            n_iov++;
+        }
 
-    while (1)
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = n_iov};
+        ssize_t n = sendmsg(cli->sockfd, &msg, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                cli->dead = 1;
+            drained = 0; // EPOLLOUT brings us back
+            break;
+        }
+        cli->queued -= n;
+
+        // Release the messages that went out whole
+        size_t done = cli->out_sent + n;
+        while (cli->out.count && done >= queue_at(&cli->out, 0)->len)
+        {
+            done -= queue_at(&cli->out, 0)->len;
+            queue_pop(&cli->out);
+            cli->queued_msgs--;
+        }
+        cli->out_sent = done;
+        if ((size_t)n < total)
+        {
+            drained = 0;
+            break;
+        }
+    }
+
+    if (cli->blocking && cli->queued <= queue_limit / 2)
     {
-        socklen_t clilen = sizeof(client_addr);
-        newsockfd = accept(sockfd, (struct sockaddr *)&client_addr, &clilen);
-        printf("****accept*******");
+        cli->blocking = 0;
+        if (--blockers == 0)
+            resume_pending = 1;
+    }
+    return drained;
+}
 
-        // Client settings
-        client_t *cli = (client_t *)malloc(sizeof(client_t));
-        cli->address = client_addr;
-        cli->sockfd = newsockfd;
-        cli->uid = uid++;
+// Writes the rest of the FRAME_CHUNK under way. Returns 1 once it is out,
+// 0 if the socket is full or the client gone.
+static int flush_chunk(client_t *cli)
+{
+    while (cli->chunk_hdr_left > 0)
+    {
+        ssize_t n = send(cli->sockfd, cli->chunk_hdr + FRAME_HEADER - cli->chunk_hdr_left, cli->chunk_hdr_left,
+                         MSG_NOSIGNAL | MSG_MORE);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                cli->dead = 1;
+            return 0;
+        }
+        cli->chunk_hdr_left -= n;
+    }
+    while (cli->chunk_left > 0)
+    {
+        ssize_t n = sendfile(cli->sockfd, cli->xfer->relay->fd, &cli->file_off, cli->chunk_left);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                cli->dead = 1; // the file shrank, or the client is gone
+            return 0;
+        }
+        cli->chunk_left -= n;
+    }
+    return 1;
+}
+
+// Whether another chunk may go into the socket. With TCP_NOTSENT_LOWAT set
+// it polls writable only while less than that waits to be sent; asking
+// also has the kernel signal EPOLLOUT once it drains, which it would not
+// do for a socket we stopped writing to on our own.
+static int chunk_room(client_t *cli)
+{
+    struct pollfd pfd = {.fd = cli->sockfd, .events = POLLOUT};
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT);
+}
+
+// Writes as much as the socket takes: queued messages, then the file being
+// relayed to this client. A v1 client gets the file as it is, and nothing
+// else until it is through. A v2 client gets it as FRAME_CHUNKs, and
+// whatever is queued goes out before each one, so chat waits for at most
+// a chunk and what little the kernel has not sent. Marks the client dead
+// on error.
+static void client_flush(client_t *cli)
+{
+    while (!cli->dead)
+    {
+        // A chunk's payload has to follow its header
+        if (cli->chunk_hdr_left > 0 || cli->chunk_left > 0)
+        {
+            if (!flush_chunk(cli))
+                return;
+            continue;
+        }
+        if (!flush_queue(cli) || !cli->xfer || !cli->ready)
+            return;
+
+        relay_t *r = cli->xfer->relay;
+        if (cli->file_off >= r->size)
+        {
+            printf("Sent %s to %s\n", r->filename, cli->name);
+            xfer_done(cli); // then whatever was held back
+            continue;
+        }
+        if (cli->file_off >= r->avail)
+            return; // relay_wake brings us back
 
-        // Add client to the queue and fork thread
-        add_client(cli);
-        pthread_create(&tid, NULL, &handle_client, (void *)cli);
+        long len = r->avail - cli->file_off;
+        if (!cli->v2)
+        {
+            ssize_t n = sendfile(cli->sockfd, r->fd, &cli->file_off, len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                    cli->dead = 1; // the file shrank, or the client is gone
+                return;
+            }
+            continue;
+        }
 
-        // Reduce CPU usage
-        sleep(1);
+        if (!chunk_room(cli))
+            return;
+        if (len > CHUNK_SIZE)
+            len = CHUNK_SIZE;
+        uint16_t t = htons(FRAME_CHUNK);
+        uint32_t l = htonl(len);
+        uint32_t seq = htonl(++out_seq);
+        memcpy(cli->chunk_hdr, &t, 2);
+        memcpy(cli->chunk_hdr + 2, &l, 4);
+        memcpy(cli->chunk_hdr + 6, &seq, 4);
+        cli->chunk_hdr_left = FRAME_HEADER;
+        cli->chunk_left = len;
     }
+}
 
-    return EXIT_SUCCESS;
+// Drops the oldest messages until len more bytes fit, leaving alone what
+// is partly written and handshakes
+static void drop_oldest(client_t *cli, size_t len)
+{
+    msg_queue_t *queues[2] = {&cli->out, &cli->held};
+    for (int k = 0; k < 2 && cli->queued + len > queue_limit; k++)
+    {
+        msg_queue_t *q = queues[k];
+        // What is kept moves up to the front
+        unsigned keep = q == &cli->out && cli->out_sent > 0 ? 1 : 0;
+        for (unsigned i = keep; i < q->count; i++)
+        {
+            msg_t *m = queue_at(q, i);
+            if (!m->control && cli->queued + len > queue_limit)
+            {
+                cli->queued -= m->len;
+                cli->queued_msgs--;
+                msgs_dropped++;
+                msg_put(m);
+                continue;
+            }
+            q->ring[(q->head + keep++) & (q->cap - 1)] = m;
+        }
+        q->count = keep;
+    }
 }
 
-void add_client(client_t *cl)
+// Queues a reference to m for a client. The write waits for the end of the
+// loop pass, so that everything queued meanwhile goes out together.
+static void queue_msg(client_t *cli, msg_t *m)
 {
-    pthread_mutex_lock(&clients_mutex);
+    if (cli->dead)
+        return;
 
-    for (int i = 0; i < MAX_CLIENTS; ++i)
+    // Only what the socket does not take counts against the limit
+    if (!m->control && cli->queued + m->len > queue_limit && cli->dirty)
+        client_flush(cli);
+    if (!m->control && cli->queued + m->len > queue_limit && !cli->dead)
     {
-        if (!clients[i])
+        if (slow_policy == SLOW_DISCONNECT)
+        {
+            printf("%s is too slow, disconnecting\n", cli->name);
+            slow_disconnects++;
+            cli->dead = 1;
+            return;
+        }
+        if (slow_policy == SLOW_DROP)
+        {
+            drop_oldest(cli, m->len);
+        }
+        else if (!cli->blocking)
         {
-            clients[i] = cl;
+            cli->blocking = 1;
+            blockers++;
+        }
+    }
+
+    // Nothing but the handshake may come between the announcement of a file
+    // and its contents in v1. In v2 chat goes between the chunks.
+    msg_queue_t *q = cli->xfer && !cli->v2 && !m->control ? &cli->held : &cli->out;
+    if (queue_push(q, m) < 0)
+    {
+        cli->dead = 1;
+        return;
+    }
+    cli->queued += m->len;
+    cli->queued_msgs++;
+    if (cli->queued > cli->queued_peak)
+        cli->queued_peak = cli->queued;
+
+    if (q == &cli->out)
+        mark_dirty(cli);
+}
+
+// Same, for a message to one client: as is to a v1 client, as a frame of
+// type to a v2 one. Control messages belong to a handshake and are queued
+// whatever the limit, ahead of what waits for a file.
+static void queue_message(client_t *cli, int type, const char *s, size_t len, int control)
+{
+    msg_t *m = cli->v2 ? frame_new(type, s, len, control) : msg_new(s, len, control);
+    if (!m)
+    {
+        cli->dead = 1;
+        return;
+    }
+    queue_msg(cli, m);
+    msg_put(m);
+}
+
+static void flush_dirty(void)
+{
+    while (dirty)
+    {
+        client_t *cli = dirty;
+        dirty = cli->dirty_next;
+        cli->dirty = 0;
+        if (!cli->dead)
+            client_flush(cli);
+    }
+}
+
+// Sends to every named client but uid. With SLOW_BLOCK, a client that
+// sends while some queue is over the limit is not read again until the
+// queue is down to half.
+static void send_message(const char *s, size_t len, int uid)
+{
+    // Built once for each protocol in use
+    msg_t *m[2] = {NULL, NULL};
+    for (int i = 0; i < clients.count; ++i)
+    {
+        client_t *cli = registry_at(&clients, i);
+        if (cli->uid == uid || cli->state == CL_NAME)
+            continue;
+        if (!m[cli->v2])
+            m[cli->v2] = cli->v2 ? frame_new(FRAME_MSG, s, len, 0) : msg_new(s, len, 0);
+        if (!m[cli->v2])
+        {
+            perror("send_message");
             break;
         }
+        queue_msg(cli, m[cli->v2]);
+    }
+    for (int v = 0; v < 2; v++)
+    {
+        if (m[v])
+            msg_put(m[v]);
     }
 
-    pthread_mutex_unlock(&clients_mutex);
+    if (blockers > 0)
+    {
+        client_t *sender = registry_find(&clients, uid);
+        if (sender)
+            sender->paused = 1;
+    }
 }
 
-void remove_client(int uid)
+// Offers the first file in the client's queue
+static void xfer_offer(client_t *cli)
 {
-    pthread_mutex_lock(&clients_mutex);
+    relay_t *r = cli->xfer->relay;
+    char file_info[BUFFER_SIZE];
+    int len = snprintf(file_info, sizeof(file_info), "%s%s%c%ld", cli->v2 ? "" : "SENDING_FILE",
+                       r->filename, DELIMITER, r->size);
+    queue_message(cli, FRAME_FILE, file_info, len, 1);
+    cli->ready = 0;
+    cli->file_off = 0;
+}
 
-    for (int i = 0; i < MAX_CLIENTS; ++i)
+// Queues the file for a recipient, offered at once if nothing is ahead
+static void xfer_add(client_t *cli, relay_t *r)
+{
+    transfer_t *x = malloc(sizeof(transfer_t));
+    if (!x)
+    {
+        cli->dead = 1;
+        return;
+    }
+    x->relay = r;
+    x->next = NULL;
+    r->pending++;
+    if (cli->xfer_tail)
     {
-        if (clients[i])
+        cli->xfer_tail->next = x;
+        cli->xfer_tail = x;
+        return;
+    }
+    cli->xfer = cli->xfer_tail = x;
+    xfer_offer(cli);
+}
+
+// Takes a file out of the client's queue. The first one has been offered
+// already, and a client told about a file it will not get is disconnected.
+static void xfer_cancel(client_t *cli, relay_t *r)
+{
+    transfer_t *prev = NULL;
+    for (transfer_t *x = cli->xfer; x; prev = x, x = x->next)
+    {
+        if (x->relay != r)
+            continue;
+        if (!prev)
         {
-            if (clients[i]->uid == uid)
+            cli->dead = 1; // the reaper releases the transfer
+            return;
+        }
+        prev->next = x->next;
+        if (cli->xfer_tail == x)
+            cli->xfer_tail = prev;
+        free(x);
+        r->pending--;
+        return;
+    }
+}
+
+// Frees the relay once the upload is over and every recipient is done
+static void relay_check(relay_t *r)
+{
+    if (r->uploading || r->pending > 0)
+        return;
+
+    close(r->fd);
+    free(r->uids);
+    free(r->skipped);
+    free(r);
+}
+
+// More of the file is in the spool: the recipients waiting for it get it
+// when the loop flushes
+static void relay_wake(relay_t *r)
+{
+    for (int i = 0; i < r->count; i++)
+    {
+        client_t *cli = registry_find(&clients, r->uids[i]);
+        if (cli && cli->xfer && cli->xfer->relay == r && cli->ready)
+            mark_dirty(cli);
+    }
+}
+
+// The spool, a file no one else can see, so that uploads of the same name
+// never share one. With -k 1 it is made in the current directory, where
+// upload_keep can give it the file's name once it is complete.
+static int spool_open(void)
+{
+    const char *dir = keep_uploads ? "." : P_tmpdir;
+    int fd = open(dir, O_TMPFILE | O_RDWR, 0666);
+    if (fd < 0)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "%s/chat_spoolXXXXXX", dir);
+        fd = mkstemp(path);
+        if (fd >= 0)
+            unlink(path);
+    }
+    return fd;
+}
+
+// With -k 1 a complete upload is kept under its name: the spool is linked
+// in, or copied where that cannot be done, under a temporary name that a
+// rename then replaces the file with. A file of that name is only ever
+// complete, and the last upload of it wins.
+static void upload_keep(relay_t *r)
+{
+    static unsigned long kept;
+    char tmp[80];
+    char proc[32];
+    snprintf(tmp, sizeof(tmp), "%s.%d-%lu.part", r->filename, (int)getpid(), ++kept);
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", r->fd);
+
+    if (linkat(AT_FDCWD, proc, AT_FDCWD, tmp, AT_SYMLINK_FOLLOW) < 0)
+    {
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd < 0)
+        {
+            perror("ERROR: Keep file");
+            return;
+        }
+        off_t off = 0;
+        while (off < r->size)
+        {
+            ssize_t n = sendfile(fd, r->fd, &off, r->size - off);
+            if (n <= 0)
             {
-                clients[i] = NULL;
-                break;
+                perror("ERROR: Keep file");
+                close(fd);
+                unlink(tmp);
+                return;
             }
         }
+        if (close(fd) < 0)
+        {
+            perror("ERROR: Keep file");
+            unlink(tmp);
+            return;
+        }
     }
+    if (rename(tmp, r->filename) < 0)
+    {
+        perror("ERROR: Keep file");
+        unlink(tmp);
+    }
+}
 
-    pthread_mutex_unlock(&clients_mutex);
+// Starts relaying an upload to every other client connected now
+static relay_t *relay_start(const char *filename, long size, int uid)
+{
+    relay_t *r = calloc(1, sizeof(relay_t));
+    if (!r || !(r->uids = malloc((clients.count + 1) * sizeof(int))))
+    {
+        free(r);
+        perror("relay");
+        return NULL;
+    }
+    r->fd = spool_open();
+    if (r->fd < 0)
+    {
+        perror("ERROR: File open");
+        free(r->uids);
+        free(r);
+        return NULL;
+    }
+    snprintf(r->filename, sizeof(r->filename), "%s", filename);
+    r->size = size;
+    r->uploading = 1;
+    size_t skipped_len = 0;
+    for (int i = 0; i < clients.count; ++i)
+    {
+        client_t *cli = registry_at(&clients, i);
+        if (cli->uid == uid || cli->state == CL_NAME || cli->dead)
+            continue;
+        // v2 sizes are 32 bits; only a v1 upload can be bigger
+        if (cli->v2 && size > UINT32_MAX)
+        {
+            if (!r->skipped)
+                r->skipped = malloc(clients.count * (sizeof(cli->name) + 2));
+            if (r->skipped)
+                skipped_len += sprintf(r->skipped + skipped_len, "%s%s", skipped_len ? ", " : "", cli->name);
+            continue;
+        }
+        r->uids[r->count++] = cli->uid;
+        xfer_add(cli, r);
+    }
+    if (r->skipped)
+        printf("%s is too big for %s\n", r->filename, r->skipped);
+    return r;
+}
+
+static void upload_end(client_t *cli)
+{
+    relay_t *r = cli->upload;
+    r->uploading = 0;
+    if (cli->pipe[0] >= 0)
+    {
+        close(cli->pipe[0]);
+        close(cli->pipe[1]);
+        cli->pipe[0] = cli->pipe[1] = -1;
+    }
+    cli->upload = NULL;
+    cli->state = CL_CHAT;
+    cli->in_data = 0;
+
+    if (!r->failed && keep_uploads)
+        upload_keep(r);
+    if (!r->failed && r->skipped)
+    {
+        // Told now rather than before "sr", which a v1 client waits for
+        char buffer[BUFFER_SIZE];
+        int len = snprintf(buffer, sizeof(buffer), "%s was not sent to %s: their clients take files up to 4 GB\n",
+                           r->filename, r->skipped);
+        queue_message(cli, FRAME_MSG, buffer, len < (int)sizeof(buffer) ? len : (int)sizeof(buffer) - 1, 0);
+    }
+    if (r->failed)
+    {
+        for (int i = 0; i < r->count; i++)
+        {
+            client_t *rcpt = registry_find(&clients, r->uids[i]);
+            if (rcpt)
+                xfer_cancel(rcpt, r);
+        }
+    }
+    relay_check(r);
+}
+
+// The client has a file for the others, and sends it when we say "sr"
+static void start_upload(client_t *cli, const char *filename, long file_size)
+{
+    printf("Receiving file: %s %ld\n", filename, file_size);
+    cli->pipe[0] = cli->pipe[1] = -1;
+    if (!no_splice && pipe2(cli->pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        perror("pipe");
+        return;
+    }
+    cli->upload = relay_start(filename, file_size, cli->uid);
+    if (!cli->upload)
+    {
+        if (cli->pipe[0] >= 0)
+        {
+            close(cli->pipe[0]);
+            close(cli->pipe[1]);
+        }
+        return;
+    }
+    cli->file_left = file_size;
+    cli->state = CL_UPLOAD;
+    queue_message(cli, FRAME_READY, "sr", cli->v2 ? 0 : 2, 1);
+
+    // A v2 client sends a FRAME_DATA even for an empty file
+    if (file_size == 0 && !cli->v2)
+    {
+        printf("File received successfully\n");
+        upload_end(cli);
+    }
+}
+
+// n more bytes of the upload are in the spool
+static void upload_advance(client_t *cli, size_t n)
+{
+    cli->upload->avail += n;
+    cli->file_left -= n;
+    cli->read_left = cli->read_left > n ? cli->read_left - n : 0;
+    if (cli->in_data && (cli->data_left -= n) == 0)
+        cli->in_data = 0;
+    relay_wake(cli->upload);
+    if (cli->file_left == 0)
+    {
+        printf("File received successfully\n");
+        upload_end(cli);
+    }
 }
 
-void send_message(char *s, int uid)
+// Part of the file being uploaded, already read
+static void upload_write(client_t *cli, const char *data, size_t len)
 {
-    pthread_mutex_lock(&clients_mutex);
+    if (pwrite(cli->upload->fd, data, len, cli->upload->avail) != (ssize_t)len)
+    {
+        perror("ERROR: Write to file");
+        cli->upload->failed = 1;
+        cli->dead = 1;
+        return;
+    }
+    upload_advance(cli, len);
+}
 
-    for (int i = 0; i < MAX_CLIENTS; ++i)
+// Moves upload data from the socket to the spool, through a pipe so that
+// it never comes up to user space. Returns 1 if some moved, 0 if the socket
+// is drained, -1 if the client is gone.
+static int upload_splice(client_t *cli)
+{
+    size_t left = cli->in_data ? cli->data_left : cli->file_left;
+    size_t want = left < UPLOAD_CHUNK ? left : UPLOAD_CHUNK;
+    if (!no_splice)
     {
-        if (clients[i])
+        ssize_t n = splice(cli->sockfd, NULL, cli->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
         {
-            if (clients[i]->uid != uid)
+            loff_t off = cli->upload->avail;
+            for (ssize_t left = n; left > 0;)
             {
-                if (write(clients[i]->sockfd, s, strlen(s)) < 0)
+                ssize_t m = splice(cli->pipe[0], NULL, cli->upload->fd, &off, left, SPLICE_F_MOVE);
+                if (m <= 0)
                 {
-                    perror("ERROR: Write to descriptor failed");
-                    break;
+                    perror("ERROR: Write to file");
+                    cli->upload->failed = 1;
+                    cli->dead = 1;
+                    return -1;
                 }
+                left -= m;
             }
+            upload_advance(cli, n);
+            return 1;
         }
+        if (n == 0)
+        {
+            cli->dead = 1;
+            return -1;
+        }
+        if (errno == EINTR)
+            return 1;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno != EINVAL && errno != ENOSYS)
+        {
+            cli->dead = 1;
+            return -1;
+        }
+        no_splice = 1; // copy then, from now on
     }
 
-    pthread_mutex_unlock(&clients_mutex);
+    char buffer[UPLOAD_CHUNK];
+    ssize_t n = recv(cli->sockfd, buffer, want, 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+        cli->dead = 1;
+        return -1;
+    }
+    if (n < 0)
+        return errno == EINTR;
+    upload_write(cli, buffer, n);
+    return cli->dead ? -1 : 1;
 }
 
-void send_file(const char *filename, int uid)
+static void client_join(client_t *cli, const char *name, size_t len)
 {
-    printf("--------send_file-------------");
-    char ready_msg[6];
+    memcpy(cli->name, name, len);
+    cli->name[len] = '\0';
+    cli->state = CL_CHAT;
+
+    char buffer[BUFFER_SIZE];
+    int msg_len = sprintf(buffer, "%s has joined\n", cli->name);
+    printf("%s", buffer);
+    send_message(buffer, msg_len, cli->uid);
+}
+
+// The client wants the file it was offered
+static void client_ready(client_t *cli)
+{
+    cli->ready = 1;
+    client_flush(cli);
+}
+
+// One read's worth of input from a v1 client. Returns how many bytes were
+// used: an upload may end in the middle of a read, and the rest is a
+// message.
+static size_t client_on_data(client_t *cli, char *data, size_t n)
+{
+    if (cli->state == CL_NAME)
+    {
+        size_t len = strnlen(data, n);
+        if (len < 2 || len > sizeof(cli->name) - 1)
+        {
+            printf("Enter the name correctly\n");
+            cli->dead = 1;
+            return n;
+        }
+        client_join(cli, data, len);
+        return n;
+    }
+
+    if (cli->state == CL_UPLOAD)
+    {
+        size_t len = n < (size_t)cli->file_left ? n : (size_t)cli->file_left;
+        upload_write(cli, data, len);
+        return len;
+    }
+
+    // The answer to a file announcement
+    if (cli->xfer && !cli->ready && n >= 5 && strncmp(data, "ready", 5) == 0)
+    {
+        client_ready(cli);
+        return 5;
+    }
 
-    struct stat file_stat;
-    off_t file_size;
-    if (stat(filename, &file_stat) == 0)
+    if (strlen(data) == 0)
+        return n;
+    if (strncmp(data, "file: ", 6) == 0)
     {
-        file_size = file_stat.st_size;
+        char filename[40];
+        long file_size;
+        if (sscanf(data, "file: %39[^#]#%ld", filename, &file_size) != 2 || file_size < 0)
+            printf("Bad file announcement from %s\n", cli->name);
+        else
+            start_upload(cli, filename, file_size);
+        return n;
     }
-    else
+    if (strcmp(data, "exit") == 0)
     {
-        perror("stat");
+        cli->dead = 1;
+        return n;
     }
-    char file_size_str[20]; // Adjust size based on your integer range
-    sprintf(file_size_str, "%c%ld", DELIMITER, file_size);
-    size_t filename_length = strlen(filename);
 
-    // Make a string with all the file data
-    int file_info_len = strlen("SENDING_FILE") + filename_length + strlen(file_size_str);
-    char file_info[file_info_len];
-    sprintf(file_info, "%s%s%s", "SENDING_FILE", filename, file_size_str);
+    send_message(data, strnlen(data, n), cli->uid);
+    printf("%s\n", data);
+    return n;
+}
 
-    pthread_mutex_lock(&clients_mutex);
+static void protocol_error(client_t *cli, const char *what)
+{
+    fprintf(stderr, "%s: %s, disconnecting\n", cli->state == CL_NAME ? inet_ntoa(cli->address.sin_addr) : cli->name, what);
+    cli->dead = 1;
+}
 
-    // printf("Trying to send: %s %ld\n", filename, file_size);
+// len bytes at off in the ring, copied to tmp if they wrap around
+static const unsigned char *ring_peek(client_t *cli, uint32_t off, uint32_t len, unsigned char *tmp)
+{
+    uint32_t start = (cli->ring_head + off) & (RING_SIZE - 1);
+    if (start + len <= RING_SIZE)
+        return cli->ring + start;
+    uint32_t first = RING_SIZE - start;
+    memcpy(tmp, cli->ring + start, first);
+    memcpy(tmp + first, cli->ring, len - first);
+    return tmp;
+}
 
-    for (int i = 0; i < MAX_CLIENTS; ++i)
+static void ring_consume(client_t *cli, uint32_t len)
+{
+    cli->ring_head = (cli->ring_head + len) & (RING_SIZE - 1);
+    cli->ring_len -= len;
+}
+
+static void client_on_frame(client_t *cli, int type, const char *payload, uint32_t len)
+{
+    if (cli->state == CL_NAME)
     {
-        if (clients[i])
+        if (type != FRAME_HELLO)
         {
-            if (clients[i]->uid != uid)
-            {
-                // Send file data
-                if (send(clients[i]->sockfd, file_info, strlen(file_info), 0) == -1)
-                {
-                    perror("send");
-                    break;
-                }
+            protocol_error(cli, "no hello");
+            return;
+        }
+        if (len < 2 || len > sizeof(cli->name) - 1 || memchr(payload, '\0', len))
+        {
+            protocol_error(cli, "bad name");
+            return;
+        }
+        queue_message(cli, FRAME_HELLO, "", 0, 1);
+        client_join(cli, payload, len);
+        return;
+    }
 
-                // Receive the signal to start sending the file
-                recv(clients[i]->sockfd, ready_msg, 5, 0);
-                ready_msg[5] = '\0';
-                // Send the file IF the signal arrived
-                if (strcmp(ready_msg, "ready") == 0)
-                {
-                    send_file_func(i, filename, file_size);
-                }
-            }
+    switch (type)
+    {
+    case FRAME_MSG:
+        send_message(payload, len, cli->uid);
+        printf("%.*s\n", (int)len, payload);
+        break;
+    case FRAME_FILE:
+    {
+        char info[64];
+        char filename[40];
+        long file_size;
+        if (len >= sizeof(info) || cli->state != CL_CHAT)
+        {
+            protocol_error(cli, "bad file frame");
+            return;
         }
+        memcpy(info, payload, len);
+        info[len] = '\0';
+        if (sscanf(info, "%39[^#]#%ld", filename, &file_size) != 2 || file_size < 0 || file_size > UINT32_MAX)
+        {
+            protocol_error(cli, "bad file frame");
+            return;
+        }
+        start_upload(cli, filename, file_size);
+        break;
     }
+    case FRAME_READY:
+        if (!cli->xfer || cli->ready)
+        {
+            protocol_error(cli, "nothing to be ready for");
+            return;
+        }
+        client_ready(cli);
+        break;
+    case FRAME_EXIT:
+        cli->dead = 1;
+        break;
+    default:
+        protocol_error(cli, "unexpected frame");
+    }
+}
+
+// Handles every complete frame in the ring, and as much of a file's
+// payload as there is
+static void client_parse_frames(client_t *cli)
+{
+    unsigned char tmp[FRAME_HEADER + MAX_PAYLOAD];
+
+    if (!cli->magic_ok)
+    {
+        if (cli->ring_len < V2_MAGIC_LEN)
+            return;
+        if (memcmp(ring_peek(cli, 0, V2_MAGIC_LEN, tmp), V2_MAGIC, V2_MAGIC_LEN) != 0)
+        {
+            protocol_error(cli, "bad magic");
+            return;
+        }
+        ring_consume(cli, V2_MAGIC_LEN);
+        cli->magic_ok = 1;
+    }
+
+    while (!cli->dead && !cli->paused)
+    {
+        if (cli->in_data)
+        {
+            // Straight from the ring to the file, a contiguous run at a time
+            uint32_t run = RING_SIZE - cli->ring_head;
+            if (run > cli->ring_len)
+                run = cli->ring_len;
+            if (run > cli->data_left)
+                run = cli->data_left;
+            if (run == 0)
+                return;
+            const unsigned char *p = cli->ring + cli->ring_head;
+            ring_consume(cli, run);
+            upload_write(cli, (const char *)p, run);
+            continue;
+        }
+
+        if (cli->ring_len < FRAME_HEADER)
+            return;
+        const unsigned char *h = ring_peek(cli, 0, FRAME_HEADER, tmp);
+        uint16_t type;
+        uint32_t len;
+        uint32_t seq;
+        memcpy(&type, h, 2);
+        memcpy(&len, h + 2, 4);
+        memcpy(&seq, h + 6, 4);
+        type = ntohs(type);
+        len = ntohl(len);
+        seq = ntohl(seq);
 
-    pthread_mutex_unlock(&clients_mutex);
+        if (type == FRAME_DATA || type == FRAME_CHUNK)
+        {
+            // The whole file in one frame, or the next part of it
+            if (cli->state != CL_UPLOAD || len > cli->file_left ||
+                (type == FRAME_DATA ? len != cli->file_left : len == 0))
+            {
+                protocol_error(cli, "unexpected data");
+                return;
+            }
+        }
+        else if (len > MAX_PAYLOAD)
+        {
+            protocol_error(cli, "frame too long");
+            return;
+        }
+        else if (cli->ring_len < FRAME_HEADER + len)
+        {
+            return; // the rest is still on its way
+        }
+        if (seq != cli->in_seq + 1)
+        {
+            protocol_error(cli, "frame out of sequence");
+            return;
+        }
+        cli->in_seq = seq;
+
+        if (type == FRAME_DATA || type == FRAME_CHUNK)
+        {
+            ring_consume(cli, FRAME_HEADER);
+            cli->in_data = 1;
+            cli->data_left = len;
+            if (len == 0)
+                upload_write(cli, NULL, 0);
+            continue;
+        }
+        const unsigned char *payload = ring_peek(cli, FRAME_HEADER, len, tmp);
+        ring_consume(cli, FRAME_HEADER + len);
+        client_on_frame(cli, type, (const char *)payload, len);
+    }
 }
 
-void send_file_func(int uid, const char *filename, long file_size)
+// An upload may come in faster than the loop gets through it. Once this
+// pass's share of it is read, the client waits for the next pass like the
+// others, and the recipients get what came so far. Returns 1 if it does.
+static int read_later(client_t *cli)
 {
-    off_t offset = 0;
-    ssize_t sent_bytes = 0;
-    size_t total_sent = 0;
-    int fd = open(filename, O_RDONLY);
-    if (fd < 0)
+    if (cli->read_left > 0)
+        return 0;
+    if (!cli->more)
     {
-        perror("open failed");
+        cli->more = 1;
+        cli->more_next = more;
+        more = cli;
     }
-    printf("(send_file_func)Ready to send %s.\n", filename);
-    // Send the file
-    while (total_sent < file_size)
+    return 1;
+}
+
+// A v2 client: reads into the ring as long as there is room, parsing as
+// it goes
+static void client_read_frames(client_t *cli)
+{
+    while (1)
     {
-        sent_bytes = sendfile(clients[uid]->sockfd, fd, &offset, file_size - total_sent);
-        if (sent_bytes == -1)
+        client_parse_frames(cli);
+        if (cli->dead || cli->paused || read_later(cli))
+            return;
+
+        // The rest of a file payload goes straight to the spool
+        if (cli->in_data && cli->ring_len == 0)
+        {
+            if (upload_splice(cli) <= 0)
+                return;
+            continue;
+        }
+
+        // The free part of the ring, in one or two pieces
+        uint32_t tail = (cli->ring_head + cli->ring_len) & (RING_SIZE - 1);
+        uint32_t room = RING_SIZE - cli->ring_len;
+        struct iovec iov[2];
+        iov[0].iov_base = cli->ring + tail;
+        iov[0].iov_len = tail + room <= RING_SIZE ? room : RING_SIZE - tail;
+        iov[1].iov_base = cli->ring;
+        iov[1].iov_len = room - iov[0].iov_len;
+
+        ssize_t n = readv(cli->sockfd, iov, iov[1].iov_len ? 2 : 1);
+        if (n == 0)
         {
-            perror("sendfile");
-            close(fd);
-            exit(EXIT_FAILURE);
+            cli->dead = 1;
+            return;
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                printf("ERROR: -1\n");
+                cli->dead = 1;
+            }
+            return; // drained, as edge triggering requires
         }
-        total_sent += sent_bytes;
+        cli->ring_len += n;
     }
 }
 
-void receive_file(int sockfd, const char *filename, long file_size)
+// The first bytes of a connection are V2_MAGIC, which no v1 name starts with
+static void client_start_v2(client_t *cli, const char *data, size_t n)
 {
-    printf("--------------receive file----------------\n");
-    char buffer[BUFFER_SIZE];
-    int n;
-    char size_received[3] = "sr";
-    // Create file
-    int file_fd = open(filename, O_WRONLY | O_CREAT, 0666);
-    if (file_fd < 0)
+    cli->ring = malloc(RING_SIZE);
+    if (!cli->ring)
     {
-        perror("ERROR: File open");
+        cli->dead = 1;
         return;
     }
+    cli->v2 = 1;
+    // Frames go out whole (a chunk's header is sent with MSG_MORE), so
+    // Nagle would only hold a chunk back until the previous one is acked
+    int on = 1;
+    int lowat = CHUNK_LOWAT;
+    if (setsockopt(cli->sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+        perror("setsockopt TCP_NODELAY");
+    if (setsockopt(cli->sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) < 0)
+        perror("setsockopt TCP_NOTSENT_LOWAT"); // chunks then fill the send buffer
+    memcpy(cli->ring, data, n);
+    cli->ring_len = n;
+}
 
-    // Send signal to start receiving the file
-    bzero(buffer, BUFFER_SIZE);
-    send(sockfd, size_received, sizeof(size_received), 0);
-
-    long total_received = 0;
+static void client_on_readable(client_t *cli)
+{
+    cli->read_left = READ_BUDGET;
+    if (cli->v2)
+    {
+        client_read_frames(cli);
+        return;
+    }
 
-    // Receive file data
-    while (total_received < file_size)
+    while (!cli->dead && !cli->paused)
     {
-        n = recv(sockfd, buffer, BUFFER_SIZE, 0);
-        if (n <= 0)
+        if (cli->state == CL_UPLOAD)
         {
-            break;
+            if (read_later(cli) || upload_splice(cli) <= 0)
+                return;
+            continue;
+        }
+
+        ssize_t n = recv(cli->sockfd, cli->in, BUFFER_SIZE, 0);
+        if (n == 0)
+        {
+            cli->dead = 1;
+            return;
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                printf("ERROR: -1\n");
+                cli->dead = 1;
+            }
+            return; // drained, as edge triggering requires
+        }
+
+        if (cli->state == CL_NAME && cli->in[0] == '\0')
+        {
+            client_start_v2(cli, cli->in, n);
+            if (!cli->dead)
+                client_read_frames(cli);
+            return;
         }
-        if (write(file_fd, buffer, n) < 0)
+
+        // Each read is handled as one message, as the protocol has no framing
+        cli->in[n] = '\0';
+        size_t used = 0;
+        while (used < (size_t)n && !cli->dead)
         {
-            perror("ERROR: Write to file");
+            used += client_on_data(cli, cli->in + used, n - used);
+        }
+    }
+}
+
+static void client_close(client_t *cli)
+{
+    if (cli->state != CL_NAME)
+    {
+        char buffer[BUFFER_SIZE];
+        int len = sprintf(buffer, "%s has left\n", cli->name);
+        printf("%s", buffer);
+        send_message(buffer, len, cli->uid);
+    }
+    if (cli->state == CL_UPLOAD)
+    {
+        fprintf(stderr, "ERROR: Incomplete file received\n");
+        cli->upload->failed = 1;
+        upload_end(cli);
+    }
+
+    if (cli->blocking && --blockers == 0)
+        resume_pending = 1;
+    for (client_t **p = &more; cli->more && *p; p = &(*p)->more_next)
+    {
+        if (*p == cli)
+        {
+            *p = cli->more_next;
             break;
         }
-        total_received += n;
     }
 
-    if (total_received < file_size)
+    close(cli->sockfd); // also takes it out of the epoll set
+    registry_remove(&clients, cli->uid);
+    queue_free(&cli->out);
+    queue_free(&cli->held);
+    free(cli->ring);
+    while (cli->xfer)
     {
-        perror("ERROR: Incomplete file received");
+        transfer_t *x = cli->xfer;
+        cli->xfer = x->next;
+        x->relay->pending--;
+        relay_check(x->relay);
+        free(x);
     }
-    printf("File received successfully\n");
-    close(file_fd);
+    free(cli);
 }
 
-void *handle_client(void *arg)
+// Takes every pending connection; the listening socket is edge triggered too
+static void accept_clients(int sockfd)
 {
-    char buffer[BUFFER_SIZE];
-    char name[32];
-    int leave_flag = 0;
+    while (1)
+    {
+        struct sockaddr_in client_addr;
+        socklen_t clilen = sizeof(client_addr);
+        int newsockfd = accept4(sockfd, (struct sockaddr *)&client_addr, &clilen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newsockfd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+
+        client_t *cli = calloc(1, sizeof(client_t));
+        if (!cli || registry_add(&clients, uid, cli) < 0)
+        {
+            fprintf(stderr, "Out of memory, refusing %s\n", inet_ntoa(client_addr.sin_addr));
+            free(cli);
+            close(newsockfd);
+            continue;
+        }
+        cli->address = client_addr;
+        cli->sockfd = newsockfd;
+        cli->uid = uid++;
 
-    client_t *cli = (client_t *)arg;
+        // Both directions, registered once: with edge triggering EPOLLOUT
+        // only fires when the socket buffer drains
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = cli;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, newsockfd, &ev) < 0)
+        {
+            perror("epoll_ctl");
+            registry_remove(&clients, cli->uid);
+            free(cli);
+            close(newsockfd);
+        }
+    }
+}
 
-    // Name
-    if (recv(cli->sockfd, name, 32, 0) <= 0 || strlen(name) < 2 || strlen(name) >= 32 - 1)
+// No queue is over the limit any more: read what the paused senders sent
+// meanwhile. There is no new edge for it.
+static void resume_senders(void)
+{
+    resume_pending = 0;
+    for (int i = 0; i < clients.count && blockers == 0; ++i)
     {
-        printf("Enter the name correctly\n");
-        leave_flag = 1;
+        client_t *cli = registry_at(&clients, i);
+        if (cli->paused && !cli->dead)
+        {
+            cli->paused = 0;
+            client_on_readable(cli);
+        }
     }
-    else
+}
+
+// Reads the uploaders that stopped for the others on the last pass
+static void read_more(void)
+{
+    client_t *list = more;
+    more = NULL;
+    while (list)
     {
-        strcpy(cli->name, name);
-        sprintf(buffer, "%s has joined\n", cli->name);
-        printf("%s", buffer);
-        send_message(buffer, cli->uid);
+        client_t *cli = list;
+        list = cli->more_next;
+        cli->more = 0;
+        if (!cli->dead && !cli->paused)
+            client_on_readable(cli);
+    }
+}
+
+static void print_report(void)
+{
+    size_t queued = 0;
+    size_t deepest = 0;
+    size_t peak = 0;
+    long msgs = 0;
+    int paused = 0;
+    const char *deepest_name = "-";
+    for (int i = 0; i < clients.count; ++i)
+    {
+        client_t *cli = registry_at(&clients, i);
+        queued += cli->queued;
+        msgs += cli->queued_msgs;
+        paused += cli->paused;
+        if (cli->queued_peak > peak)
+            peak = cli->queued_peak;
+        if (cli->queued > deepest)
+        {
+            deepest = cli->queued;
+            deepest_name = cli->name;
+        }
     }
+    fprintf(stderr, "%d clients, %zu bytes in %ld messages queued, deepest %zu (%s), peak %zu\n",
+            clients.count, queued, msgs, deepest, deepest_name, peak);
+    fprintf(stderr, "%llu messages dropped, %llu clients disconnected for being slow, %d blocking, %d senders paused\n",
+            msgs_dropped, slow_disconnects, blockers, paused);
+}
 
-    bzero(buffer, BUFFER_SIZE);
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-q queue_bytes] [-p drop|disconnect|block] [-k 0|1] <server_ip>\n", prog);
+    fprintf(stderr, "  -q  most bytes waiting to be written to one client (default %d)\n", DEFAULT_QUEUE_BYTES);
+    fprintf(stderr, "  -p  what to do when that fills up: drop its oldest messages (default),\n");
+    fprintf(stderr, "      disconnect it, or stop reading senders until it is half empty\n");
+    fprintf(stderr, "  -k  keep uploaded files in the current directory (default 1)\n");
+    fprintf(stderr, "SIGUSR1 prints queue depths.\n");
+    exit(EXIT_FAILURE);
+}
 
-    while (1)
+int main(int argc, char *argv[])
+{
+    signal(SIGTERM, handler);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, report_handler);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "q:p:k:")) != -1)
     {
-        if (leave_flag)
+        switch (opt)
         {
+        case 'q':
+            if (atol(optarg) < MIN_QUEUE_BYTES)
+                usage(argv[0]);
+            queue_limit = atol(optarg);
+            break;
+        case 'p':
+            if (strcmp(optarg, "drop") == 0)
+                slow_policy = SLOW_DROP;
+            else if (strcmp(optarg, "disconnect") == 0)
+                slow_policy = SLOW_DISCONNECT;
+            else if (strcmp(optarg, "block") == 0)
+                slow_policy = SLOW_BLOCK;
+            else
+                usage(argv[0]);
+            break;
+        case 'k':
+            if (strcmp(optarg, "0") != 0 && strcmp(optarg, "1") != 0)
+                usage(argv[0]);
+            keep_uploads = optarg[0] - '0';
             break;
+        default:
+            usage(argv[0]);
         }
+    }
+    // Give the IP as a parameter
+    if (optind + 1 != argc)
+        usage(argv[0]);
+    const char *server_ip = argv[optind];
 
-        int receive = recv(cli->sockfd, buffer, BUFFER_SIZE, 0);
-        if (receive > 0)
+    // One descriptor per client: take as many as we are allowed
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (registry_init(&clients) < 0)
+    {
+        perror("registry");
+        return EXIT_FAILURE;
+    }
+
+    int sockfd;
+    struct sockaddr_in server_addr;
+
+    // Socket settings
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(server_ip);
+    server_addr.sin_port = htons(PORT);
+    int one = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    // Bind
+    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("ERROR: Bind failed");
+        return EXIT_FAILURE;
+    }
+
+    // Listen
+    if (listen(sockfd, SOMAXCONN) < 0)
+    {
+        perror("ERROR: Socket listen");
+        return EXIT_FAILURE;
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL; // the listening socket
+    if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0)
+    {
+        perror("epoll");
+        return EXIT_FAILURE;
+    }
+
+    printf("Listening on: %s:%d\n", inet_ntoa(server_addr.sin_addr), ntohs(server_addr.sin_port));
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1)
+    {
+        int nfds = epoll_wait(epfd, events, MAX_EVENTS, more ? 0 : -1);
+        if (report)
         {
-            if (strlen(buffer) > 0)
-            {
-                if (strncmp(buffer, "file: ", 6) == 0)
-                {
-                    char filename[40]; // Buffer to store the filename
-                    long file_size;    // Variable to store the file size
-
-                    // Use sscanf to extract the filename and file size
-                    sscanf(buffer, "file: %[^#]#%ld", filename, &file_size);
-                    printf("Receiving file: %s %ld\n", filename, file_size);
-                    receive_file(cli->sockfd, filename, file_size);
-                    send_file(filename, cli->uid);
-                }
-                else
-                {
-                    send_message(buffer, cli->uid);
-                    buffer[receive] = '\0'; // Ensure buffer is null-terminated
-                    printf("%s\n", buffer);
-                }
-            }
+            report = 0;
+            print_report();
         }
-        else if (receive == 0 || strcmp(buffer, "exit") == 0)
+        if (nfds < 0)
         {
-            sprintf(buffer, "%s has left\n", cli->name);
-            printf("%s", buffer);
-            send_message(buffer, cli->uid);
-            leave_flag = 1;
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return EXIT_FAILURE;
         }
-        else
+
+        for (int i = 0; i < nfds; i++)
         {
-            printf("ERROR: -1\n");
-            leave_flag = 1;
+            client_t *cli = events[i].data.ptr;
+            if (!cli)
+            {
+                accept_clients(sockfd);
+                continue;
+            }
+            if (cli->dead)
+                continue;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                client_on_readable(cli);
+            if ((events[i].events & EPOLLOUT) && !cli->dead)
+                client_flush(cli);
         }
+        read_more();
 
-        bzero(buffer, BUFFER_SIZE);
-    }
+        // Everything queued during the pass goes out now, one sendmsg per
+        // client, then senders held back for a queue that drained or went
+        // away are read. Clients are only released here, so none goes away
+        // while an event for it may still be in the batch, and only with
+        // the dirty list empty. Saying goodbye to one can fail a write to
+        // another.
+        while (1)
+        {
+            if (resume_pending)
+                resume_senders();
+            flush_dirty();
 
-    close(cli->sockfd);
-    remove_client(cli->uid);
-    free(cli);
-    pthread_detach(pthread_self());
+            int i = clients.count - 1;
+            while (i >= 0 && !((client_t *)registry_at(&clients, i))->dead)
+                i--;
+            if (i < 0 && !resume_pending && !dirty)
+                break;
+            if (i >= 0)
+                client_close(registry_at(&clients, i));
+        }
+    }
 
-    return NULL;
+    return EXIT_SUCCESS;
 }
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "netsim.h"
+
+int netsim_send(const netsim_link_t *link, netsim_dir_t *d, int len, long long now, long long at[2], int *reordered)
+{
+    if (reordered)
+        *reordered = 0;
+
+    // Serialization: packets queue behind each other at the link rate, and
+    // a full queue drops what arrives
+    long long departs = now;
+    if (link->rate)
+    {
+        if (d->free > departs)
+            departs = d->free;
+        if (link->queue && (departs - now) * link->rate / 1000000 > link->queue)
+            return NETSIM_DROPPED;
+        departs += len * 1000000LL / link->rate;
+        d->free = departs;
+    }
+
+    if (netsim_rng_unit(d->rng) < link->loss)
+        return 0;
+
+    int copies = netsim_rng_unit(d->rng) < link->dup ? 2 : 1;
+    for (int i = 0; i < copies; i++)
+    {
+        at[i] = departs + link->delay;
+        if (link->jitter)
+            at[i] += netsim_rng_next(d->rng) % (link->jitter + 1);
+
+        // A reordered packet is held back behind later ones; jitter alone
+        // does not reorder, the link is a queue
+        if (netsim_rng_unit(d->rng) < link->reorder)
+        {
+            at[i] += netsim_rng_next(d->rng) % (2 * (link->delay + link->jitter) + 1000);
+            if (reordered)
+                (*reordered)++;
+        }
+        else if (at[i] < d->last)
+        {
+            at[i] = d->last;
+        }
+        else
+        {
+            d->last = at[i];
+        }
+    }
+    return copies;
+}
+
+void netsim_heap_init(netsim_heap_t *h, size_t size)
+{
+    memset(h, 0, sizeof(*h));
+    h->size = size;
+}
+
+static int key_before(const netsim_key_t *a, const netsim_key_t *b)
+{
+    return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+void *netsim_heap_push(netsim_heap_t *h, long long at)
+{
+    if (h->len == h->cap)
+    {
+        int cap = h->cap ? h->cap * 2 : 1024;
+        h->keys = realloc(h->keys, cap * sizeof(netsim_key_t));
+        h->items = realloc(h->items, cap * h->size);
+        h->free_slots = realloc(h->free_slots, cap * sizeof(int));
+        if (!h->keys || !h->items || !h->free_slots)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        // Every slot is taken, the new ones are the free ones
+        for (int i = cap - 1; i >= h->cap; i--)
+            h->free_slots[cap - 1 - i] = i;
+        h->cap = cap;
+    }
+
+    netsim_key_t k = {at, h->seq++, h->free_slots[h->cap - h->len - 1]};
+    int i = h->len++;
+    while (i > 0 && key_before(&k, &h->keys[(i - 1) / 2]))
+    {
+        h->keys[i] = h->keys[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h->keys[i] = k;
+    return h->items + (size_t)k.slot * h->size;
+}
+
+void *netsim_heap_pop(netsim_heap_t *h)
+{
+    int slot = h->keys[0].slot;
+
+    netsim_key_t last = h->keys[--h->len];
+    h->free_slots[h->cap - h->len - 1] = slot;
+    int i = 0;
+    while (1)
+    {
+        int child = 2 * i + 1;
+        if (child >= h->len)
+            break;
+        if (child + 1 < h->len && key_before(&h->keys[child + 1], &h->keys[child]))
+            child++;
+        if (!key_before(&h->keys[child], &last))
+            break;
+        h->keys[i] = h->keys[child];
+        i = child;
+    }
+    if (h->len > 0)
+        h->keys[i] = last;
+    return h->items + (size_t)slot * h->size;
+}
+
+void netsim_heap_clear(netsim_heap_t *h)
+{
+    for (int i = 0; i < h->cap; i++)
+        h->free_slots[i] = h->cap - 1 - i;
+    h->len = 0;
+}
+
+void netsim_heap_free(netsim_heap_t *h)
+{
+    free(h->keys);
+    free(h->items);
+    free(h->free_slots);
+    h->keys = NULL;
+    h->items = NULL;
+    h->free_slots = NULL;
+    h->len = h->cap = 0;
+}
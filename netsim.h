@@ -0,0 +1,97 @@
+#ifndef NETSIM_H
+#define NETSIM_H
+
+// The impaired link shared by tftp_sim (virtual time) and udp_proxy (real
+// sockets): packets are serialized at a rate, then dropped, duplicated,
+// delayed and reordered at random, and wait in a heap ordered by arrival
+// time until they are due. Everything random comes from xorshift64*
+// generators the caller seeds, so a seed replays the same impairments.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Returned by netsim_send for a packet the rate limit queue had no room for
+#define NETSIM_DROPPED -1
+
+typedef struct
+{
+    double loss;      // probability that a packet is dropped
+    double dup;       // ... delivered twice
+    double reorder;   // ... held back behind packets sent after it
+    long long delay;  // one-way, microseconds
+    long long jitter; // extra delay, uniform up to this
+    long long rate;   // bytes/s each way, 0 for no limit
+    long long queue;  // bytes waiting for the rate limit before tail drop, 0 for no limit
+} netsim_link_t;
+
+// One direction of the link
+typedef struct
+{
+    uint64_t *rng;  // generator state, may be shared with the other direction
+    long long free; // when it has sent its last byte
+    long long last; // latest arrival queued
+} netsim_dir_t;
+
+// Where an item is in the heap: ordered by at, and those due at the same
+// time in the order they were pushed. The items themselves stay in their
+// slots, so only keys move.
+typedef struct
+{
+    long long at;
+    uint64_t seq;
+    int slot;
+} netsim_key_t;
+
+typedef struct
+{
+    netsim_key_t *keys;
+    unsigned char *items; // cap slots of size bytes
+    int *free_slots;      // cap - len of them
+    size_t size;
+    int len;
+    int cap;
+    uint64_t seq;
+} netsim_heap_t;
+
+static inline uint64_t netsim_rng_next(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+// Uniform in [0, 1)
+static inline double netsim_rng_unit(uint64_t *state)
+{
+    return (netsim_rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Sends len bytes (headers included) at time now. Returns how many copies
+// arrive, 0 to 2, with their arrival times in at, or NETSIM_DROPPED.
+// *reordered, if not NULL, is set to how many of them were held back.
+int netsim_send(const netsim_link_t *link, netsim_dir_t *d, int len, long long now, long long at[2], int *reordered);
+
+// For items of size bytes
+void netsim_heap_init(netsim_heap_t *h, size_t size);
+
+// Adds an item due at at and returns it for the caller to fill in. Exits
+// if out of memory.
+void *netsim_heap_push(netsim_heap_t *h, long long at);
+
+// Removes the earliest item and returns it, valid until the next push; the
+// heap must not be empty
+void *netsim_heap_pop(netsim_heap_t *h);
+
+// Forgets every item
+void netsim_heap_clear(netsim_heap_t *h);
+
+void netsim_heap_free(netsim_heap_t *h);
+
+// When the earliest item is due, -1 if there is none
+static inline long long netsim_heap_next(const netsim_heap_t *h)
+{
+    return h->len ? h->keys[0].at : -1;
+}
+
+#endif
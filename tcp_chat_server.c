@@ -7,10 +7,10 @@
 #include <sys/stat.h>
 #include <sys/sendfile.h>
 #include <pthread.h>
+#include "chat_registry.h"
 
 #define PORT 8080
 #define BUFFER_SIZE 1024
-#define MAX_CLIENTS 10
 
 typedef struct
 {
@@ -20,10 +20,10 @@ typedef struct
     char name[32];
 } client_t;
 
-client_t *clients[MAX_CLIENTS];
+registry_t clients;
 pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-void add_client(client_t *cl);
+int add_client(client_t *cl);
 void remove_client(int uid);
 void send_message(char *s, int uid);
 void *handle_client(void *arg);
@@ -40,6 +40,12 @@ int main(int argc, char *argv[])
     }
     const char *server_ip = argv[1];
 
+    if (registry_init(&clients) < 0)
+    {
+        perror("registry");
+        return EXIT_FAILURE;
+    }
+
     int sockfd, newsockfd;
     struct sockaddr_in server_addr, client_addr;
     pthread_t tid;
@@ -79,48 +85,32 @@ int main(int argc, char *argv[])
         cli->uid = uid++;
 
         // Add client to the queue and fork thread
-        add_client(cli);
+        if (add_client(cli) < 0)
+        {
+            fprintf(stderr, "Out of memory, refusing %s\n", inet_ntoa(client_addr.sin_addr));
+            close(newsockfd);
+            free(cli);
+            continue;
+        }
         pthread_create(&tid, NULL, &handle_client, (void *)cli);
-
-        // Reduce CPU usage
-        sleep(1);
     }
 
     return EXIT_SUCCESS;
 }
 
-void add_client(client_t *cl)
+int add_client(client_t *cl)
 {
     pthread_mutex_lock(&clients_mutex);
-
-    for (int i = 0; i < MAX_CLIENTS; ++i)
-    {
-        if (!clients[i])
-        {
-            clients[i] = cl;
-            break;
-        }
-    }
-
+    int slot = registry_add(&clients, cl->uid, cl);
     pthread_mutex_unlock(&clients_mutex);
+
+    return slot < 0 ? -1 : 0;
 }
 
 void remove_client(int uid)
 {
     pthread_mutex_lock(&clients_mutex);
-
-    for (int i = 0; i < MAX_CLIENTS; ++i)
-    {
-        if (clients[i])
-        {
-            if (clients[i]->uid == uid)
-            {
-                clients[i] = NULL;
-                break;
-            }
-        }
-    }
-
+    registry_remove(&clients, uid);
     pthread_mutex_unlock(&clients_mutex);
 }
 
@@ -128,17 +118,15 @@ void send_message(char *s, int uid)
 {
     pthread_mutex_lock(&clients_mutex);
 
-    for (int i = 0; i < MAX_CLIENTS; ++i)
+    for (int i = 0; i < clients.count; ++i)
     {
-        if (clients[i])
+        client_t *cli = registry_at(&clients, i);
+        if (cli->uid != uid)
         {
-            if (clients[i]->uid != uid)
+            if (write(cli->sockfd, s, strlen(s)) < 0)
             {
-                if (write(clients[i]->sockfd, s, strlen(s)) < 0)
-                {
-                    perror("ERROR: Write to descriptor failed");
-                    break;
-                }
+                perror("ERROR: Write to descriptor failed");
+                break;
             }
         }
     }
@@ -1,41 +1,510 @@
+#define _GNU_SOURCE // fallocate
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
-#include <sys/time.h>
+#include <getopt.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "tftp_engine.h"
+#include "tftp_netascii.h"
 
 #define BUF_SIZE 516
-#define DATA_SIZE 512
 
-#define OP_RRQ 1
-#define OP_WRQ 2
-#define OP_DATA 3
-#define OP_ACK 4
-#define OP_ERROR 5
+#define MIN_BLKSIZE 8
+#define MAX_BLKSIZE 65464
+#define MAX_WINDOWSIZE 65535
+#define PKT_OVERHEAD 32 // IPv4 + UDP + TFTP headers
 
-void send_rrq(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, const char *filename, const char *mode)
+#define ERR_UNDEFINED 0
+#define ERR_DISK_FULL 3
+#define ERR_UNKNOWN_TID 5
+#define ERR_OPTION 8
+
+// Multicast block numbers never wrap, see tftp_server.c
+#define MCAST_MAX_BLOCKS 65535
+
+#define MIN_TIMEOUT 1 // RFC 2349, in seconds
+#define MAX_TIMEOUT 255
+
+#define BATCH_CONCURRENT 16 // default -c
+#define BATCH_EVENTS 64
+
+// Options to request from the server; 0 (ROLLOVER_UNSET for rollover,
+// -1 for tsize) means the option is not sent
+typedef struct
 {
-    char buffer[BUF_SIZE];
-    int msg_len = snprintf(buffer, BUF_SIZE, "%c%c%s%c%s%c", 0, OP_RRQ, filename, 0, mode, 0);
-    sendto(sockfd, buffer, msg_len, 0, (struct sockaddr *)server_addr, server_len);
+    int blksize;
+    int windowsize;
+    int rollover;
+    int multicast;
+    long long tsize; // 0 in a RRQ, the file size in a WRQ
+    int timeout;
+} options_t;
+
+#define ROLLOVER_UNSET -1
+
+// The transfer: block size, window size and block number wrap-around
+// value as negotiated, block numbers and the retransmission timer
+static tftp_engine_t engine;
+static long long tsize = -1; // size of the file being read, if announced
+
+// RFC 2090 session announced in the OACK, if we asked for one
+static int multicast;
+static struct sockaddr_in mc_group;
+static int mc_master; // we ACK on behalf of the group
+
+// Netascii mode (-a): line endings are converted on the way. Sending
+// walks the mapped file with a mark per block of the window, so any of
+// them can be built again for a retransmission.
+static int netascii;
+static netascii_decoder_t nad;
+static netascii_mark_t *marks; // by block % (windowsize + 1)
+
+// Request as last sent, repeated until the server answers
+static char request[BUF_SIZE];
+static int request_len;
+
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Arms the timer after sending; retransmissions are not timed (Karn)
+static void timer_start(int fresh)
+{
+    tftp_engine_arm(&engine, fresh, now_us());
+}
+
+// Waits for a packet until the retransmission deadline. Returns 0 when the
+// timer expired.
+static int wait_for_packet(int sockfd)
+{
+    struct pollfd pfd = {sockfd, POLLIN, 0};
+
+    while (1)
+    {
+        long long left = engine.deadline - now_us();
+        if (left <= 0)
+            return 0;
+
+        int rc = poll(&pfd, 1, (int)((left + 999) / 1000));
+        if (rc > 0)
+            return 1;
+        if (rc < 0 && errno != EINTR)
+        {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+    }
 }
 
-void send_wrq(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, const char *filename, const char *mode)
+static int append_option(char *buffer, int msg_len, const char *name, int value)
+{
+    if (value <= 0 || msg_len >= BUF_SIZE)
+        return msg_len;
+    msg_len += snprintf(buffer + msg_len, BUF_SIZE - msg_len, "%s%c%d%c", name, 0, value, 0);
+    return msg_len > BUF_SIZE ? BUF_SIZE : msg_len;
+}
+
+// Builds a RRQ/WRQ with the requested options appended
+static int build_request(char *buffer, int opcode, const char *filename, const char *mode, options_t *req)
+{
+    int msg_len = snprintf(buffer, BUF_SIZE, "%c%c%s%c%s%c", 0, opcode, filename, 0, mode, 0);
+    msg_len = append_option(buffer, msg_len, "blksize", req->blksize);
+    msg_len = append_option(buffer, msg_len, "windowsize", req->windowsize);
+    if (req->rollover != ROLLOVER_UNSET && msg_len < BUF_SIZE)
+        msg_len += snprintf(buffer + msg_len, BUF_SIZE - msg_len, "rollover%c%d%c", 0, req->rollover, 0);
+    if (req->multicast && msg_len < BUF_SIZE)
+        msg_len += snprintf(buffer + msg_len, BUF_SIZE - msg_len, "multicast%c%c", 0, 0);
+    if (req->tsize >= 0 && msg_len < BUF_SIZE)
+        msg_len += snprintf(buffer + msg_len, BUF_SIZE - msg_len, "tsize%c%lld%c", 0, req->tsize, 0);
+    msg_len = append_option(buffer, msg_len, "timeout", req->timeout);
+    return msg_len > BUF_SIZE ? BUF_SIZE : msg_len;
+}
+
+void send_rrq(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, const char *filename, const char *mode, options_t *req)
+{
+    request_len = build_request(request, OP_RRQ, filename, mode, req);
+    sendto(sockfd, request, request_len, 0, (struct sockaddr *)server_addr, server_len);
+    timer_start(1);
+}
+
+void send_wrq(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, const char *filename, const char *mode, options_t *req)
+{
+    request_len = build_request(request, OP_WRQ, filename, mode, req);
+    sendto(sockfd, request, request_len, 0, (struct sockaddr *)server_addr, server_len);
+    timer_start(1);
+}
+
+// Repeats the request after a timeout, while the server has not answered
+static void resend_request(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len)
+{
+    printf("Timeout, sending the request again\n");
+    sendto(sockfd, request, request_len, 0, (struct sockaddr *)server_addr, server_len);
+    timer_start(0);
+}
+
+void send_error(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, int error_code, const char *error_msg)
 {
     char buffer[BUF_SIZE];
-    int msg_len = snprintf(buffer, BUF_SIZE, "%c%c%s%c%s%c", 0, OP_WRQ, filename, 0, mode, 0);
+    int msg_len = snprintf(buffer, BUF_SIZE, "%c%c%c%c%s%c", 0, OP_ERROR, 0, error_code, error_msg, 0);
     sendto(sockfd, buffer, msg_len, 0, (struct sockaddr *)server_addr, server_len);
 }
 
-void send_ack(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, int block_num)
+// Reads the options acknowledged by the server. Returns -1 if the server
+// answered with something we never asked for.
+int parse_oack(unsigned char *buffer, ssize_t len, options_t *req, tftp_engine_t *e, long long *size)
 {
-    char ack_packet[4] = {0, OP_ACK, (block_num >> 8) & 0xFF, block_num & 0xFF};
+    char *opt = (char *)buffer + 2;
+    char *end = (char *)buffer + len;
+
+    while (opt < end)
+    {
+        char *value = opt + strnlen(opt, end - opt) + 1;
+        if (value >= end)
+            return -1;
+
+        int granted = atoi(value);
+        if (strcasecmp(opt, "blksize") == 0)
+        {
+            if (granted < MIN_BLKSIZE || granted > req->blksize)
+                return -1;
+            e->blksize = granted;
+        }
+        else if (strcasecmp(opt, "windowsize") == 0)
+        {
+            if (granted < 1 || granted > req->windowsize)
+                return -1;
+            e->windowsize = granted;
+        }
+        else if (strcasecmp(opt, "rollover") == 0)
+        {
+            if (req->rollover == ROLLOVER_UNSET || granted != req->rollover)
+                return -1;
+            e->rollover = granted;
+        }
+        else if (strcasecmp(opt, "tsize") == 0)
+        {
+            if (req->tsize < 0)
+                return -1;
+            *size = atoll(value);
+        }
+        else if (strcasecmp(opt, "timeout") == 0)
+        {
+            // Must be acknowledged as sent; both sides then retransmit
+            // after at most that long
+            if (granted != req->timeout)
+                return -1;
+            tftp_engine_set_timeout(e, granted * 1000000LL);
+        }
+        else if (strcasecmp(opt, "multicast") == 0)
+        {
+            // "addr,port,mc"; the address and port may be left out once known
+            char addr[INET_ADDRSTRLEN];
+            int port, master;
+            if (!req->multicast)
+                return -1;
+            if (sscanf(value, "%15[0-9.],%d,%d", addr, &port, &master) == 3)
+            {
+                if (inet_pton(AF_INET, addr, &mc_group.sin_addr) <= 0 || port <= 0 || port > 65535)
+                    return -1;
+                mc_group.sin_family = AF_INET;
+                mc_group.sin_port = htons(port);
+            }
+            else if (!multicast || sscanf(value, ",,%d", &master) != 1)
+            {
+                return -1;
+            }
+            multicast = 1;
+            mc_master = master == 1;
+        }
+        else
+        {
+            return -1;
+        }
+
+        opt = value + strnlen(value, end - value) + 1;
+    }
+    return 0;
+}
+
+// Grows both socket buffers to at least bytes (the kernel clamps this to
+// net.core.[rw]mem_max), never shrinking the defaults
+static void grow_socket_buffers(int sockfd, int bytes)
+{
+    int cur;
+    socklen_t len = sizeof(cur);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &cur, &len) == 0 && cur >= bytes)
+        return;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes));
+}
+
+// Handles an OACK received in place of the first ACK or DATA
+static void accept_oack(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, unsigned char *buffer, ssize_t len, options_t *req, int fd)
+{
+    if (parse_oack(buffer, len, req, &engine, &tsize) < 0)
+    {
+        send_error(sockfd, server_addr, server_len, ERR_OPTION, "Unexpected option");
+        fprintf(stderr, "Server sent an invalid OACK\n");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    printf("Block size %d, window size %d negotiated\n", engine.blksize, engine.windowsize);
+
+    // Leave room for a whole window in the socket buffers
+    grow_socket_buffers(sockfd, engine.windowsize * (engine.blksize + 4 + PKT_OVERHEAD));
+}
+
+void send_ack(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, uint64_t block_num)
+{
+    uint16_t wire = tftp_block_to_wire(block_num, engine.rollover);
+    char ack_packet[4] = {0, OP_ACK, wire >> 8, wire & 0xFF};
     sendto(sockfd, ack_packet, sizeof(ack_packet), 0, (struct sockaddr *)server_addr, server_len);
 }
 
-void receive_file(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, const char *filename)
+// Acknowledges the last block received in order and arms the timer
+static void ack_received(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, int fresh)
+{
+    unsigned char packet[4];
+    size_t len = tftp_engine_ack(&engine, packet, fresh, now_us());
+    sendto(sockfd, packet, len, 0, (struct sockaddr *)server_addr, server_len);
+}
+
+// Reserves room for the announced size up front, so a large download does
+// not fragment and a full disk shows before the transfer starts
+static void preallocate(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, int fd)
+{
+    if (tsize <= 0 || fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, tsize) == 0)
+        return;
+    if (errno == ENOSPC || errno == EDQUOT)
+    {
+        send_error(sockfd, server_addr, server_len, ERR_DISK_FULL, "Disk full or allocation exceeded");
+        fprintf(stderr, "No room for %lld bytes\n", tsize);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Writes a received block where it belongs. If the file does not take it
+// all, tells the server instead of acknowledging data we do not have, and
+// gives up.
+static void write_block(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, int fd,
+                        const unsigned char *data, size_t len, uint64_t offset)
+{
+    ssize_t n = pwrite(fd, data, len, (off_t)offset);
+    if (n == (ssize_t)len)
+        return;
+
+    // A short write means the disk filled up
+    int err = n < 0 ? errno : ENOSPC;
+    if (err == ENOSPC || err == EDQUOT)
+        send_error(sockfd, server_addr, server_len, ERR_DISK_FULL, "Disk full or allocation exceeded");
+    else
+        send_error(sockfd, server_addr, server_len, ERR_UNDEFINED, strerror(err));
+    fprintf(stderr, "write: %s\n", strerror(err));
+    close(fd);
+    exit(EXIT_FAILURE);
+}
+
+// Joins the group on the interface we reach the server through
+static int join_group(struct sockaddr_in *server_addr)
+{
+    struct sockaddr_in local;
+    socklen_t local_len = sizeof(local);
+    int probe = socket(AF_INET, SOCK_DGRAM, 0);
+    if (probe < 0 || connect(probe, (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0 ||
+        getsockname(probe, (struct sockaddr *)&local, &local_len) < 0)
+    {
+        perror("probe");
+        exit(EXIT_FAILURE);
+    }
+    close(probe);
+
+    // Other clients on this host may be listening to the same group
+    int one = 1;
+    int mcfd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr = mc_group.sin_addr;
+    mreq.imr_interface = local.sin_addr;
+    if (mcfd < 0 || setsockopt(mcfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(mcfd, (struct sockaddr *)&mc_group, sizeof(mc_group)) < 0 ||
+        setsockopt(mcfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+    {
+        perror("multicast group");
+        exit(EXIT_FAILURE);
+    }
+    grow_socket_buffers(mcfd, engine.windowsize * (engine.blksize + 4 + PKT_OVERHEAD));
+    return mcfd;
+}
+
+// RFC 2090 receive, after the OACK. DATA arrives on the group in whatever
+// order the current master asks for it and is written where it belongs.
+// While we are the master we ACK the end of the run of blocks held from
+// the start; otherwise we only listen until the server makes us master,
+// then ask for what we missed.
+static void receive_multicast(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, int fd, unsigned char *buffer)
+{
+    int mcfd = join_group(server_addr);
+    unsigned char *have = calloc(MCAST_MAX_BLOCKS / 8 + 1, 1);
+    uint64_t prefix = 0;     // blocks 1 to prefix have all arrived
+    uint64_t last_block = 0; // the short one, once seen
+    uint64_t acked = 0;      // our last ACK as master
+    int nak_sent = 0;
+    int retries = 0;
+
+    if (!have)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    printf("Listening on %s:%d as %s client\n", inet_ntoa(mc_group.sin_addr), ntohs(mc_group.sin_port), mc_master ? "master" : "passive");
+
+    if (mc_master)
+    {
+        send_ack(sockfd, server_addr, server_len, 0);
+        timer_start(1);
+    }
+    else
+    {
+        engine.deadline = now_us() + MAX_RTO_US;
+    }
+
+    struct pollfd pfds[2] = {{sockfd, POLLIN, 0}, {mcfd, POLLIN, 0}};
+    while (1)
+    {
+        long long left = engine.deadline - now_us();
+        int rc = left > 0 ? poll(pfds, 2, (int)((left + 999) / 1000)) : 0;
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        if (rc == 0)
+        {
+            // A passive client only gives up after a long silence
+            if (++retries > MAX_RETRIES)
+            {
+                fprintf(stderr, "Transfer timed out\n");
+                close(fd);
+                exit(EXIT_FAILURE);
+            }
+            if (mc_master)
+            {
+                tftp_rtt_backoff(&engine.rtt);
+                printf("Timeout, acknowledging block %" PRIu64 " again\n", prefix);
+                send_ack(sockfd, server_addr, server_len, prefix);
+                acked = prefix;
+                timer_start(0);
+            }
+            else
+            {
+                engine.deadline = now_us() + MAX_RTO_US;
+            }
+            continue;
+        }
+
+        if (pfds[0].revents & POLLIN)
+        {
+            ssize_t n = recvfrom(sockfd, buffer, MAX_BLKSIZE + 4, MSG_DONTWAIT, (struct sockaddr *)server_addr, &server_len);
+            if (n >= 4 && buffer[1] == OP_OACK)
+            {
+                options_t any = {MAX_BLKSIZE, MAX_WINDOWSIZE, ROLLOVER_UNSET, 1, 0, 0};
+                any.rollover = engine.rollover;
+                if (parse_oack(buffer, n, &any, &engine, &tsize) < 0)
+                    continue;
+                if (mc_master)
+                {
+                    printf("Now the master client, missing blocks after %" PRIu64 "\n", prefix);
+                    send_ack(sockfd, server_addr, server_len, prefix);
+                    if (last_block && prefix == last_block)
+                        break;
+                    acked = prefix;
+                    nak_sent = 0;
+                    retries = 0;
+                    timer_start(1);
+                }
+            }
+            else if (n >= 4 && buffer[1] == OP_ERROR)
+            {
+                fprintf(stderr, "Error from server: %s\n", buffer + 4);
+                close(fd);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if (!(pfds[1].revents & POLLIN))
+            continue;
+
+        ssize_t n = recv(mcfd, buffer, MAX_BLKSIZE + 4, MSG_DONTWAIT);
+        if (n < 4 || buffer[1] != OP_DATA)
+            continue;
+
+        uint64_t block = (buffer[2] << 8) | buffer[3];
+        if (block == 0)
+            continue;
+        if (!(have[block / 8] & (1 << block % 8)))
+        {
+            write_block(sockfd, server_addr, server_len, fd, buffer + 4, n - 4, (block - 1) * engine.blksize);
+            have[block / 8] |= 1 << block % 8;
+            if (n < engine.blksize + 4)
+                last_block = block;
+        }
+        while (prefix < MCAST_MAX_BLOCKS && (have[(prefix + 1) / 8] & (1 << (prefix + 1) % 8)))
+        {
+            prefix++;
+            nak_sent = 0;
+        }
+        retries = 0;
+
+        if (!mc_master)
+        {
+            engine.deadline = now_us() + MAX_RTO_US;
+            continue;
+        }
+
+        if (block == acked + 1)
+            tftp_engine_answered(&engine, now_us());
+        if (last_block && prefix == last_block)
+        {
+            send_ack(sockfd, server_addr, server_len, prefix);
+            break;
+        }
+        if (prefix >= acked + engine.windowsize || (block > prefix + 1 && !nak_sent))
+        {
+            // A whole window, or a gap the server has to go back for
+            nak_sent = block > prefix + 1;
+            send_ack(sockfd, server_addr, server_len, prefix);
+            acked = prefix;
+            timer_start(1);
+        }
+        else
+        {
+            engine.deadline = now_us() + engine.rtt.rto;
+        }
+    }
+
+    printf("Received %" PRIu64 " blocks\n", last_block);
+    free(have);
+    close(mcfd);
+}
+
+void receive_file(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, const char *filename, options_t *req)
 {
     int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
     if (fd < 0)
@@ -44,35 +513,93 @@ void receive_file(int sockfd, struct sockaddr_in *server_addr, socklen_t server_
         exit(EXIT_FAILURE);
     }
 
-    char buffer[BUF_SIZE];
-    int block_num = 0;
+    unsigned char *buffer = malloc(MAX_BLKSIZE + 4);
+    unsigned char *text = malloc(MAX_BLKSIZE + 1); // a block converted from netascii
+    uint64_t offset = 0; // bytes written so far
+    int got_oack = 0;
     ssize_t bytes_received;
 
+    if (!buffer || !text)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
     while (1)
     {
-        bytes_received = recvfrom(sockfd, buffer, BUF_SIZE, 0, (struct sockaddr *)server_addr, &server_len);
+        // Without DATA for a while, repeat our last ACK so the server resends
+        if (!wait_for_packet(sockfd))
+        {
+            int action = tftp_engine_on_timeout(&engine, now_us());
+            if (action & TE_FAIL)
+            {
+                fprintf(stderr, "Transfer timed out\n");
+                close(fd);
+                exit(EXIT_FAILURE);
+            }
+            if ((action & TE_SEND_ACK) || got_oack)
+            {
+                printf("Timeout, acknowledging block %" PRIu64 " again\n", engine.block);
+                ack_received(sockfd, server_addr, server_len, 0);
+            }
+            else
+            {
+                resend_request(sockfd, server_addr, server_len);
+            }
+            continue;
+        }
+
+        bytes_received = recvfrom(sockfd, buffer, MAX_BLKSIZE + 4, MSG_DONTWAIT, (struct sockaddr *)server_addr, &server_len);
         if (bytes_received < 0)
         {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
             perror("recvfrom");
             close(fd);
             exit(EXIT_FAILURE);
         }
+        if (bytes_received < 4)
+            continue;
 
         int opcode = buffer[1];
-        int recv_block_num = (buffer[2] << 8) | buffer[3];
-
-        if (opcode == OP_DATA && recv_block_num == block_num + 1)
+        if (opcode == OP_OACK && engine.state == TE_START)
         {
-            write(fd, buffer + 4, bytes_received - 4);
-            send_ack(sockfd, server_addr, server_len, recv_block_num);
-            block_num++;
-
-            if (bytes_received < BUF_SIZE)
+            if (!got_oack)
+                tftp_engine_answered(&engine, now_us());
+            accept_oack(sockfd, server_addr, server_len, buffer, bytes_received, req, fd);
+            preallocate(sockfd, server_addr, server_len, fd);
+            if (multicast)
             {
-                // Last packet received
+                receive_multicast(sockfd, server_addr, server_len, fd, buffer);
                 break;
             }
-            printf("Block %d received.\n", block_num);
+            ack_received(sockfd, server_addr, server_len, 1);
+            got_oack = 1;
+        }
+        else if (opcode == OP_DATA)
+        {
+            // Duplicate or out of order DATA gets what we have acknowledged
+            // once, so the server restarts its window right after it
+            int action = tftp_engine_on_data(&engine, (buffer[2] << 8) | buffer[3], bytes_received - 4, now_us());
+            if (action & TE_DELIVER)
+            {
+                unsigned char *data = buffer + 4;
+                size_t len = bytes_received - 4;
+                if (netascii)
+                {
+                    len = netascii_decode(&nad, data, len, text);
+                    if (action & TE_LAST)
+                        len += netascii_decode_end(&nad, text + len);
+                    data = text;
+                }
+                write_block(sockfd, server_addr, server_len, fd, data, len, offset);
+                offset += len;
+                printf("Block %" PRIu64 " received.\n", engine.block);
+            }
+            if (action & TE_SEND_ACK)
+                ack_received(sockfd, server_addr, server_len, 1);
+            if (action & TE_LAST)
+                break;
         }
         else if (opcode == OP_ERROR)
         {
@@ -80,7 +607,7 @@ void receive_file(int sockfd, struct sockaddr_in *server_addr, socklen_t server_
             close(fd);
             exit(EXIT_FAILURE);
         }
-        else
+        else if (opcode != OP_OACK)
         {
             fprintf(stderr, "Unexpected packet received\n");
             close(fd);
@@ -88,10 +615,51 @@ void receive_file(int sockfd, struct sockaddr_in *server_addr, socklen_t server_
         }
     }
 
+    free(text);
+    free(buffer);
     close(fd);
 }
 
-void send_file(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, const char *filename)
+// Transmits what is left of the current window
+static void send_window(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, int fd, const unsigned char *text, uint64_t text_size, unsigned char *buffer)
+{
+    uint64_t first = engine.next;
+    uint64_t end = tftp_engine_window_end(&engine);
+    int ring = engine.windowsize + 1;
+
+    for (uint64_t block = first; block <= end; block++)
+    {
+        ssize_t bytes_read;
+        if (netascii)
+        {
+            netascii_mark_t m = marks[block % ring];
+            bytes_read = netascii_encode(text, text_size, &m, buffer + 4, engine.blksize);
+            marks[(block + 1) % ring] = m;
+        }
+        else
+        {
+            bytes_read = pread(fd, buffer + 4, engine.blksize, (off_t)((block - 1) * engine.blksize));
+        }
+        if (bytes_read < 0)
+        {
+            perror("read");
+            close(fd);
+            exit(EXIT_FAILURE);
+        }
+
+        tftp_engine_data_header(&engine, block, buffer);
+        if (sendto(sockfd, buffer, bytes_read + 4, 0, (struct sockaddr *)server_addr, server_len) < 0)
+        {
+            perror("sendto");
+            close(fd);
+            exit(EXIT_FAILURE);
+        }
+        tftp_engine_sent(&engine, 1, now_us());
+    }
+    printf("Window %" PRIu64 "-%" PRIu64 " sent, waiting for ACK\n", first, end);
+}
+
+void send_file(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, const char *filename, options_t *req)
 {
     int fd = open(filename, O_RDONLY);
     if (fd < 0)
@@ -100,113 +668,671 @@ void send_file(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len
         exit(EXIT_FAILURE);
     }
 
-    char buffer[BUF_SIZE];
-    char data_block[DATA_SIZE];
-    int block_num = 0;
-    ssize_t bytes_read, bytes_sent, bytes_received;
-    struct timeval timeout;
-    timeout.tv_sec = 1; // 1 second timeout
-    timeout.tv_usec = 0;
-
-    // Wait for initial ACK from server
-    while (1)
+    struct stat st;
+    unsigned char *buffer = malloc(MAX_BLKSIZE + 4);
+    unsigned char ack_buffer[BUF_SIZE];
+    ssize_t bytes_received;
+
+    if (!buffer || fstat(fd, &st) < 0)
     {
-        bytes_received = recvfrom(sockfd, buffer, BUF_SIZE, 0, (struct sockaddr *)server_addr, &server_len);
+        perror("send_file");
+        exit(EXIT_FAILURE);
+    }
+
+    // In netascii the blocks are cut from the converted file
+    const unsigned char *text = NULL;
+    uint64_t size = st.st_size;
+    if (netascii && st.st_size > 0)
+    {
+        text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text == MAP_FAILED)
+        {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        size = netascii_encoded_size(text, st.st_size);
+    }
+    engine.last = size / engine.blksize + 1;
+
+    // Announce the size as it goes on the wire, so the server can refuse
+    // what will not fit
+    if (S_ISREG(st.st_mode))
+        req->tsize = size;
+    send_wrq(sockfd, server_addr, server_len, filename, netascii ? "netascii" : "octet", req);
+
+    // Wait for initial ACK (or OACK) from server
+    int action = 0;
+    while (!(action & TE_SEND_DATA))
+    {
+        if (!wait_for_packet(sockfd))
+        {
+            if (tftp_engine_on_timeout(&engine, now_us()) & TE_FAIL)
+            {
+                fprintf(stderr, "Transfer timed out\n");
+                close(fd);
+                exit(EXIT_FAILURE);
+            }
+            resend_request(sockfd, server_addr, server_len);
+            continue;
+        }
+
+        bytes_received = recvfrom(sockfd, buffer, MAX_BLKSIZE + 4, MSG_DONTWAIT, (struct sockaddr *)server_addr, &server_len);
         if (bytes_received < 0)
         {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
             perror("recvfrom");
             close(fd);
             exit(EXIT_FAILURE);
         }
+        if (bytes_received < 4)
+            continue;
 
         int opcode = buffer[1];
         if (opcode == OP_ACK)
         {
-            int recv_block_num = (buffer[2] << 8) | buffer[3];
-            if (recv_block_num == block_num)
-            {
+            action = tftp_engine_on_ack(&engine, (buffer[2] << 8) | buffer[3], now_us());
+            if (action)
                 printf("Initial ACK received\n");
-                break;
-            }
+        }
+        else if (opcode == OP_OACK)
+        {
+            accept_oack(sockfd, server_addr, server_len, buffer, bytes_received, req, fd);
+            engine.last = size / engine.blksize + 1;
+            tftp_engine_answered(&engine, now_us());
+            action = tftp_engine_begin(&engine, now_us());
+        }
+        else if (opcode == OP_ERROR)
+        {
+            fprintf(stderr, "Error from server: %s\n", buffer + 4);
+            close(fd);
+            exit(EXIT_FAILURE);
         }
     }
 
-    block_num = 1;
-    do
+    if (netascii)
     {
-        bytes_read = read(fd, data_block, DATA_SIZE);
-        if (bytes_read < 0)
+        marks = malloc((engine.windowsize + 1) * sizeof(netascii_mark_t));
+        if (!marks)
         {
-            perror("read");
-            close(fd);
+            perror("malloc");
             exit(EXIT_FAILURE);
         }
+        marks[1 % (engine.windowsize + 1)] = (netascii_mark_t){0, -1};
+    }
 
-        snprintf(buffer, BUF_SIZE, "%c%c%c%c", 0, OP_DATA, block_num >> 8, block_num & 0xFF);
-        memcpy(buffer + 4, data_block, bytes_read);
+    while (!(action & TE_DONE))
+    {
+        // A window starting right after the last ACK. After a timeout or a
+        // partial ACK this resends everything not acknowledged.
+        if (action & TE_SEND_DATA)
+            send_window(sockfd, server_addr, server_len, fd, text, st.st_size, buffer);
 
-        while (1)
+        if (!wait_for_packet(sockfd))
         {
-            bytes_sent = sendto(sockfd, buffer, bytes_read + 4, 0, (struct sockaddr *)server_addr, server_len);
-            if (bytes_sent < 0)
+            action = tftp_engine_on_timeout(&engine, now_us());
+            if (action & TE_FAIL)
             {
-                perror("sendto");
+                fprintf(stderr, "Transfer timed out\n");
                 close(fd);
                 exit(EXIT_FAILURE);
             }
+            if (action & TE_SEND_DATA)
+                printf("Retrying from block %" PRIu64 "\n", engine.block + 1);
+            continue;
+        }
 
-            printf("Block %d sent, waiting for ACK\n", block_num);
+        bytes_received = recvfrom(sockfd, ack_buffer, BUF_SIZE, MSG_DONTWAIT, (struct sockaddr *)server_addr, &server_len);
+        action = 0;
+        if (bytes_received < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
+            perror("recvfrom");
+            close(fd);
+            exit(EXIT_FAILURE);
+        }
+        if (bytes_received < 4)
+            continue;
 
-            // Set socket timeout for ACK
-            setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+        int opcode = ack_buffer[1];
+        if (opcode == OP_ACK)
+        {
+            // Duplicate ACKs are ignored, resending on them would double
+            // every packet from then on (Sorcerer's Apprentice)
+            action = tftp_engine_on_ack(&engine, (ack_buffer[2] << 8) | ack_buffer[3], now_us());
+            if (action)
+                printf("Valid ACK for block %" PRIu64 " received\n", engine.block);
+        }
+        else if (opcode == OP_ERROR)
+        {
+            fprintf(stderr, "Error from server: %s\n", ack_buffer + 4);
+            close(fd);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (text)
+        munmap((void *)text, st.st_size);
+    free(marks);
+    free(buffer);
+    close(fd);
+}
 
-            bytes_received = recvfrom(sockfd, buffer, BUF_SIZE, 0, (struct sockaddr *)server_addr, &server_len);
-            if (bytes_received < 0)
+// Batch mode (-B): the files of a manifest, up to -c of them at a time,
+// each with its own socket (TID) and engine, all driven from one epoll
+// loop. A transfer finishes when its last block is received or
+// acknowledged, like the single file mode, without dallying.
+typedef struct
+{
+    int sockfd;
+    int fd;
+    const char *filename;
+    int opcode;
+    tftp_engine_t te;
+    options_t opts; // as requested, tsize included
+    int connected; // to the server's TID, once it answered
+    int got_oack;
+    char request[BUF_SIZE];
+    int request_len;
+    long long size; // WRQ: the file; RRQ: as announced, -1 if not
+    uint64_t bytes;
+    long long started;
+} transfer_t;
+
+typedef struct
+{
+    int opcode;
+    char *filename;
+} manifest_entry_t;
+
+static struct sockaddr_in batch_server;
+static int batch_epfd;
+
+// Reads "r <file>" and "w <file>" lines; blank lines and # comments are
+// skipped. Returns the number of entries, -1 on a malformed line.
+static int read_manifest(const char *path, manifest_entry_t **entries)
+{
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f)
+    {
+        perror(path);
+        return -1;
+    }
+
+    int n = 0, cap = 0, lineno = 0;
+    char line[1024];
+    *entries = NULL;
+    while (fgets(line, sizeof(line), f))
+    {
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *p = line + strspn(line, " \t");
+        if (*p == '\0' || *p == '#')
+            continue;
+
+        char *name = p + 1 + strspn(p + 1, " \t");
+        if ((*p != 'r' && *p != 'w') || (p[1] != ' ' && p[1] != '\t') || *name == '\0')
+        {
+            fprintf(stderr, "%s:%d: expected \"r <file>\" or \"w <file>\"\n", path, lineno);
+            return -1;
+        }
+        if (n == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            *entries = realloc(*entries, cap * sizeof(manifest_entry_t));
+            if (!*entries)
             {
-                perror("recvfrom");
-                printf("Retrying block %d\n", block_num);
-                continue;
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        (*entries)[n].opcode = *p == 'r' ? OP_RRQ : OP_WRQ;
+        (*entries)[n].filename = strdup(name);
+        n++;
+    }
+    if (f != stdin)
+        fclose(f);
+    return n;
+}
+
+static void transfer_send(transfer_t *t, const void *buf, size_t len)
+{
+    // A full socket buffer counts as a loss; the timer recovers it
+    if (t->connected)
+        send(t->sockfd, buf, len, 0);
+    else
+        sendto(t->sockfd, buf, len, 0, (struct sockaddr *)&batch_server, sizeof(batch_server));
+}
+
+static void transfer_error(transfer_t *t, int error_code, const char *error_msg)
+{
+    char buffer[BUF_SIZE];
+    int msg_len = snprintf(buffer, BUF_SIZE, "%c%c%c%c%s%c", 0, OP_ERROR, 0, error_code, error_msg, 0);
+    transfer_send(t, buffer, msg_len);
+}
+
+static void transfer_ack(transfer_t *t, int fresh)
+{
+    unsigned char packet[4];
+    size_t len = tftp_engine_ack(&t->te, packet, fresh, now_us());
+    transfer_send(t, packet, len);
+}
+
+// Returns -1 if the file could not be read
+static int transfer_send_window(transfer_t *t, unsigned char *buffer)
+{
+    uint64_t first = t->te.next;
+    uint64_t end = tftp_engine_window_end(&t->te);
+    for (uint64_t block = first; block <= end; block++)
+    {
+        ssize_t bytes_read = pread(t->fd, buffer + 4, t->te.blksize, (off_t)((block - 1) * t->te.blksize));
+        if (bytes_read < 0)
+        {
+            perror(t->filename);
+            return -1;
+        }
+        tftp_engine_data_header(&t->te, block, buffer);
+        transfer_send(t, buffer, bytes_read + 4);
+    }
+    tftp_engine_sent(&t->te, (int)(end - first + 1), now_us());
+    return 0;
+}
+
+// Opens the file and the transfer's socket and sends its request. Returns
+// -1 if it could not start.
+static int transfer_start(transfer_t *t, manifest_entry_t *entry, options_t *req)
+{
+    memset(t, 0, sizeof(*t));
+    t->opcode = entry->opcode;
+    t->filename = entry->filename;
+    t->size = -1;
+
+    t->opts = *req;
+    struct stat st;
+    if (t->opcode == OP_RRQ)
+    {
+        t->fd = open(t->filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        t->opts.tsize = 0;
+    }
+    else
+    {
+        t->fd = open(t->filename, O_RDONLY);
+        if (t->fd >= 0 && fstat(t->fd, &st) == 0)
+            t->size = t->opts.tsize = st.st_size;
+    }
+    if (t->fd < 0 || (t->opcode == OP_WRQ && t->size < 0))
+    {
+        perror(t->filename);
+        if (t->fd >= 0)
+            close(t->fd);
+        return -1;
+    }
+
+    t->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = t;
+    if (t->sockfd < 0 || epoll_ctl(batch_epfd, EPOLL_CTL_ADD, t->sockfd, &ev) < 0)
+    {
+        perror("socket");
+        if (t->sockfd >= 0)
+            close(t->sockfd);
+        close(t->fd);
+        return -1;
+    }
+
+    tftp_engine_init(&t->te, t->opcode == OP_RRQ ? TE_RECEIVER : TE_SENDER, 0);
+    if (req->timeout)
+        tftp_engine_set_timeout(&t->te, req->timeout * 1000000LL);
+    if (t->opcode == OP_WRQ)
+        t->te.last = t->size / t->te.blksize + 1;
+
+    t->request_len = build_request(t->request, t->opcode, t->filename, "octet", &t->opts);
+    t->started = now_us();
+    transfer_send(t, t->request, t->request_len);
+    tftp_engine_arm(&t->te, 1, t->started);
+    return 0;
+}
+
+// Releases the transfer and reports how it went
+static void transfer_end(transfer_t *t, int ok)
+{
+    double elapsed = (now_us() - t->started) / 1e6;
+    if (ok)
+        printf("%s %s: %" PRIu64 " bytes in %.3f s\n", t->opcode == OP_RRQ ? "Received" : "Sent", t->filename, t->bytes, elapsed);
+    else
+        printf("Failed %s after %.3f s\n", t->filename, elapsed);
+
+    epoll_ctl(batch_epfd, EPOLL_CTL_DEL, t->sockfd, NULL);
+    close(t->sockfd);
+    close(t->fd);
+    t->sockfd = -1;
+}
+
+// Handles an OACK received in place of the first ACK or DATA. Returns -1
+// if the transfer has to be abandoned.
+static int transfer_oack(transfer_t *t, unsigned char *buffer, ssize_t n)
+{
+    long long now = now_us();
+    if (parse_oack(buffer, n, &t->opts, &t->te, &t->size) < 0)
+    {
+        transfer_error(t, ERR_OPTION, "Unexpected option");
+        fprintf(stderr, "%s: server sent an invalid OACK\n", t->filename);
+        return -1;
+    }
+    grow_socket_buffers(t->sockfd, t->te.windowsize * (t->te.blksize + 4 + PKT_OVERHEAD));
+    if (!t->got_oack)
+        tftp_engine_answered(&t->te, now);
+
+    if (t->opcode == OP_WRQ)
+    {
+        t->te.last = t->size / t->te.blksize + 1;
+        tftp_engine_begin(&t->te, now);
+        return transfer_send_window(t, buffer);
+    }
+
+    if (!t->got_oack && t->size > 0 && fallocate(t->fd, FALLOC_FL_KEEP_SIZE, 0, t->size) < 0 &&
+        (errno == ENOSPC || errno == EDQUOT))
+    {
+        transfer_error(t, ERR_DISK_FULL, "Disk full or allocation exceeded");
+        fprintf(stderr, "%s: no room for %lld bytes\n", t->filename, t->size);
+        return -1;
+    }
+    t->got_oack = 1;
+    transfer_ack(t, 1);
+    return 0;
+}
+
+// Returns 1 once the transfer is over, with *ok telling how
+static int transfer_on_packet(transfer_t *t, unsigned char *buffer, ssize_t n, struct sockaddr_in *from, int *ok)
+{
+    *ok = 0;
+    if (n < 4)
+        return 0;
+    if (!t->connected)
+    {
+        // The first answer comes from the server's TID for this transfer;
+        // anyone else answering our request is turned away (RFC 1350)
+        if (from->sin_addr.s_addr != batch_server.sin_addr.s_addr)
+        {
+            send_error(t->sockfd, from, sizeof(*from), ERR_UNKNOWN_TID, "Unknown transfer ID");
+            return 0;
+        }
+        if (connect(t->sockfd, (struct sockaddr *)from, sizeof(*from)) == 0)
+            t->connected = 1;
+    }
+
+    long long now = now_us();
+    int opcode = buffer[1];
+    uint16_t wire = (buffer[2] << 8) | buffer[3];
+
+    if (opcode == OP_ERROR)
+    {
+        fprintf(stderr, "%s: error from server: %.*s\n", t->filename, (int)(n - 4), buffer + 4);
+        return 1;
+    }
+    if (opcode == OP_OACK)
+    {
+        if (t->te.state != TE_START)
+            return 0;
+        return transfer_oack(t, buffer, n) < 0;
+    }
+
+    if (opcode == OP_DATA && t->opcode == OP_RRQ)
+    {
+        int action = tftp_engine_on_data(&t->te, wire, n - 4, now);
+        if (action & TE_DELIVER)
+        {
+            if (pwrite(t->fd, buffer + 4, n - 4, (off_t)t->bytes) != n - 4)
+            {
+                perror(t->filename);
+                transfer_error(t, ERR_DISK_FULL, "Disk full or allocation exceeded");
+                return 1;
             }
+            t->bytes += n - 4;
+        }
+        if (action & TE_SEND_ACK)
+            transfer_ack(t, 1);
+        *ok = (action & TE_LAST) != 0;
+        return *ok;
+    }
+    if (opcode == OP_ACK && t->opcode == OP_WRQ)
+    {
+        int action = tftp_engine_on_ack(&t->te, wire, now);
+        if (action & TE_DONE)
+        {
+            t->bytes = t->size;
+            *ok = 1;
+            return 1;
+        }
+        if ((action & TE_SEND_DATA) && transfer_send_window(t, buffer) < 0)
+            return 1;
+    }
+    return 0;
+}
 
-            int opcode = buffer[1];
-            int recv_block_num = ((buffer[2] << 8) | (buffer[3] & 0x0FF));
+// Returns 1 once the transfer gave up
+static int transfer_on_timeout(transfer_t *t, unsigned char *buffer)
+{
+    int action = tftp_engine_on_timeout(&t->te, now_us());
+    if (action & TE_FAIL)
+    {
+        fprintf(stderr, "%s: transfer timed out\n", t->filename);
+        return 1;
+    }
+    if (action & TE_RESEND)
+    {
+        if (t->got_oack)
+            transfer_ack(t, 0); // ACK 0 of the OACK
+        else
+            transfer_send(t, t->request, t->request_len);
+        tftp_engine_arm(&t->te, 0, now_us());
+    }
+    else if (action & TE_SEND_ACK)
+    {
+        transfer_ack(t, 0);
+    }
+    else if ((action & TE_SEND_DATA) && transfer_send_window(t, buffer) < 0)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+// Runs every transfer in the manifest, concurrent at a time. Returns the
+// number that failed.
+static int run_batch(manifest_entry_t *entries, int count, int concurrent, options_t *req)
+{
+    if (concurrent > count)
+        concurrent = count;
+    transfer_t *transfers = calloc(concurrent, sizeof(transfer_t));
+    unsigned char *buffer = malloc(MAX_BLKSIZE + 4);
+    batch_epfd = epoll_create1(0);
+    if (!transfers || !buffer || batch_epfd < 0)
+    {
+        perror("batch");
+        exit(EXIT_FAILURE);
+    }
+
+    int next = 0, running = 0, failed = 0;
+    long long begin = now_us();
 
-            if (opcode == OP_ACK && recv_block_num == block_num)
+    for (int i = 0; i < concurrent; i++)
+        transfers[i].sockfd = -1;
+
+    struct epoll_event events[BATCH_EVENTS];
+    while (1)
+    {
+        // Fill free slots from the manifest, skipping files that cannot start
+        for (int i = 0; i < concurrent && next < count; i++)
+        {
+            while (transfers[i].sockfd < 0 && next < count)
             {
-                printf("Valid ACK for block %d received\n", block_num);
-                block_num++;
-                break;
+                if (transfer_start(&transfers[i], &entries[next++], req) == 0)
+                    running++;
+                else
+                    failed++;
             }
-            else if (opcode == OP_ERROR)
+        }
+        if (running == 0)
+            break;
+
+        // Sleep until the earliest retransmission deadline
+        long long now = now_us();
+        long long deadline = now + MAX_RTO_US;
+        for (int i = 0; i < concurrent; i++)
+        {
+            if (transfers[i].sockfd >= 0 && transfers[i].te.deadline < deadline)
+                deadline = transfers[i].te.deadline;
+        }
+        int timeout = deadline > now ? (int)((deadline - now + 999) / 1000) : 0;
+        int nfds = epoll_wait(batch_epfd, events, BATCH_EVENTS, timeout);
+        if (nfds < 0 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < nfds; i++)
+        {
+            transfer_t *t = events[i].data.ptr;
+            while (t->sockfd >= 0)
             {
-                fprintf(stderr, "Error from server: %s\n", buffer + 4);
-                close(fd);
-                exit(EXIT_FAILURE);
+                struct sockaddr_in from;
+                socklen_t from_len = sizeof(from);
+                ssize_t n = recvfrom(t->sockfd, buffer, MAX_BLKSIZE + 4, 0, (struct sockaddr *)&from, &from_len);
+                if (n < 0)
+                    break;
+
+                int ok;
+                if (transfer_on_packet(t, buffer, n, &from, &ok))
+                {
+                    transfer_end(t, ok);
+                    running--;
+                    failed += !ok;
+                }
             }
-            else
+        }
+
+        now = now_us();
+        for (int i = 0; i < concurrent; i++)
+        {
+            transfer_t *t = &transfers[i];
+            if (t->sockfd >= 0 && t->te.deadline <= now && transfer_on_timeout(t, buffer))
             {
-                fprintf(stderr, "Unexpected packet received\n");
-                close(fd);
-                exit(EXIT_FAILURE);
+                transfer_end(t, 0);
+                running--;
+                failed++;
             }
         }
-    } while (bytes_read == DATA_SIZE);
+    }
 
-    close(fd);
+    printf("%d of %d transfers completed in %.3f s\n", count - failed, count, (now_us() - begin) / 1e6);
+    close(batch_epfd);
+    free(buffer);
+    free(transfers);
+    return failed;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-b blksize] [-w windowsize] [-r 0|1] [-t timeout] [-M | -a] <server_ip> <server_port> <filename> <mode>\n", prog);
+    fprintf(stderr, "       %s [-b blksize] [-w windowsize] [-r 0|1] [-t timeout] -B manifest [-c concurrent] <server_ip> <server_port>\n", prog);
+    fprintf(stderr, "  -b  request a block size between %d and %d bytes (RFC 2348)\n", MIN_BLKSIZE, MAX_BLKSIZE);
+    fprintf(stderr, "  -w  request a window of up to %d blocks per ACK (RFC 7440)\n", MAX_WINDOWSIZE);
+    fprintf(stderr, "  -r  ask for block numbers to wrap to 0 or 1 after 65535 (default 0)\n");
+    fprintf(stderr, "  -t  retransmission timeout in seconds, %d to %d, negotiated with the server (RFC 2349)\n", MIN_TIMEOUT, MAX_TIMEOUT);
+    fprintf(stderr, "  -M  ask to receive the file by multicast (RFC 2090)\n");
+    fprintf(stderr, "  -a  transfer in netascii mode, converting line endings\n");
+    fprintf(stderr, "  -B  transfer every file listed in manifest (- for stdin), one \"r <file>\" or \"w <file>\" per line\n");
+    fprintf(stderr, "  -c  with -B, transfers running at once (default %d)\n", BATCH_CONCURRENT);
+    exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 5)
+    options_t req = {0, 0, ROLLOVER_UNSET, 0, -1, 0};
+    const char *manifest = NULL;
+    int concurrent = BATCH_CONCURRENT;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:w:r:t:MaB:c:")) != -1)
     {
-        fprintf(stderr, "Usage: %s <server_ip> <server_port> <filename> <mode>\n", argv[0]);
-        exit(EXIT_FAILURE);
+        switch (opt)
+        {
+        case 'b':
+            req.blksize = atoi(optarg);
+            if (req.blksize < MIN_BLKSIZE || req.blksize > MAX_BLKSIZE)
+                usage(argv[0]);
+            break;
+        case 'w':
+            req.windowsize = atoi(optarg);
+            if (req.windowsize < 1 || req.windowsize > MAX_WINDOWSIZE)
+                usage(argv[0]);
+            break;
+        case 'r':
+            if (strcmp(optarg, "0") != 0 && strcmp(optarg, "1") != 0)
+                usage(argv[0]);
+            req.rollover = optarg[0] - '0';
+            break;
+        case 't':
+            req.timeout = atoi(optarg);
+            if (req.timeout < MIN_TIMEOUT || req.timeout > MAX_TIMEOUT)
+                usage(argv[0]);
+            break;
+        case 'M':
+            req.multicast = 1;
+            break;
+        case 'a':
+            netascii = 1;
+            break;
+        case 'B':
+            manifest = optarg;
+            break;
+        case 'c':
+            concurrent = atoi(optarg);
+            if (concurrent < 1)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (manifest ? argc - optind != 2 || req.multicast || netascii : argc - optind != 4 || (req.multicast && netascii))
+        usage(argv[0]);
+
+    const char *server_ip = argv[optind];
+    int server_port = atoi(argv[optind + 1]);
+
+    if (manifest)
+    {
+        manifest_entry_t *entries;
+        int count = read_manifest(manifest, &entries);
+        if (count < 0)
+            exit(EXIT_FAILURE);
+
+        memset(&batch_server, 0, sizeof(batch_server));
+        batch_server.sin_family = AF_INET;
+        batch_server.sin_port = htons(server_port);
+        if (inet_pton(AF_INET, server_ip, &batch_server.sin_addr) <= 0)
+        {
+            fprintf(stderr, "Invalid address %s\n", server_ip);
+            exit(EXIT_FAILURE);
+        }
+
+        // One socket per transfer running
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)concurrent * 2 + 16)
+        {
+            rl.rlim_cur = rl.rlim_max < (rlim_t)concurrent * 2 + 16 ? rl.rlim_max : (rlim_t)concurrent * 2 + 16;
+            setrlimit(RLIMIT_NOFILE, &rl);
+        }
+        return run_batch(entries, count, concurrent, &req) ? EXIT_FAILURE : 0;
     }
 
-    const char *server_ip = argv[1];
-    int server_port = atoi(argv[2]);
-    const char *filename = argv[3];
-    const char *mode = argv[4];
+    const char *filename = argv[optind + 2];
+    const char *mode = argv[optind + 3];
 
     int sockfd;
     struct sockaddr_in server_addr;
@@ -233,13 +1359,19 @@ int main(int argc, char *argv[])
     // Depending on the mode, perform RRQ or WRQ
     if (strcmp(mode, "r") == 0) // Read mode
     {
-        send_rrq(sockfd, &server_addr, server_len, filename, "octet");
-        receive_file(sockfd, &server_addr, server_len, filename);
+        req.tsize = 0; // the server fills in the size (RFC 2349)
+        tftp_engine_init(&engine, TE_RECEIVER, 0);
+        if (req.timeout) // also how long to wait for the server to answer
+            tftp_engine_set_timeout(&engine, req.timeout * 1000000LL);
+        send_rrq(sockfd, &server_addr, server_len, filename, netascii ? "netascii" : "octet", &req);
+        receive_file(sockfd, &server_addr, server_len, filename, &req);
     }
     else if (strcmp(mode, "w") == 0) // Write mode
     {
-        send_wrq(sockfd, &server_addr, server_len, filename, "octet");
-        send_file(sockfd, &server_addr, server_len, filename);
+        tftp_engine_init(&engine, TE_SENDER, 0);
+        if (req.timeout)
+            tftp_engine_set_timeout(&engine, req.timeout * 1000000LL);
+        send_file(sockfd, &server_addr, server_len, filename, &req);
     }
     else
     {
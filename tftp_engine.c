@@ -0,0 +1,283 @@
+#include <string.h>
+#include "tftp_engine.h"
+
+void tftp_rtt_init(tftp_rtt_t *r, long long rto)
+{
+    r->srtt = 0;
+    r->rttvar = 0;
+    r->rto = rto;
+    r->max = rto > MAX_RTO_US ? rto : MAX_RTO_US;
+}
+
+// Folds a measured round trip into the estimator: SRTT += (R - SRTT) / 8,
+// RTTVAR += (|R - SRTT| - RTTVAR) / 4 and RTO = SRTT + 4 * RTTVAR
+void tftp_rtt_sample(tftp_rtt_t *r, long long sample)
+{
+    if (sample < 1)
+        sample = 1;
+
+    if (r->srtt == 0)
+    {
+        r->srtt = sample;
+        r->rttvar = sample / 2;
+    }
+    else
+    {
+        long long err = sample - r->srtt;
+        r->srtt += err / 8;
+        r->rttvar += ((err < 0 ? -err : err) - r->rttvar) / 4;
+    }
+
+    r->rto = r->srtt + 4 * r->rttvar;
+    if (r->rto < MIN_RTO_US)
+        r->rto = MIN_RTO_US;
+    if (r->rto > r->max)
+        r->rto = r->max;
+}
+
+void tftp_rtt_backoff(tftp_rtt_t *r)
+{
+    r->rto *= 2;
+    if (r->rto > r->max)
+        r->rto = r->max;
+}
+
+// Number carried on the wire for a 64-bit block counter. With rollover 0
+// the sequence is ..., 65535, 0, 1, ...; with rollover 1 it skips 0 after
+// the first wrap, since 0 otherwise only ever means "ACK of the OACK/WRQ".
+uint16_t tftp_block_to_wire(uint64_t block, int rollover)
+{
+    if (block == 0 || rollover == 0)
+        return block & 0xFFFF;
+    return (block - 1) % 0xFFFF + 1;
+}
+
+// Maps a block number from the wire to the first counter at or above base
+// that carries it. Callers check the result against the window they expect.
+uint64_t tftp_wire_to_block(uint16_t wire, uint64_t base, int rollover)
+{
+    if (rollover == 0)
+        return base + (uint16_t)(wire - base);
+    if (wire == 0)
+        return base; // only valid as ACK 0, which needs base == 0 anyway
+    if (base == 0)
+        return wire;
+    return base + (wire + 0xFFFF - tftp_block_to_wire(base, 1)) % 0xFFFF;
+}
+
+// Plain RFC 1350 settings until options are negotiated
+void tftp_engine_init(tftp_engine_t *e, int role, int rollover)
+{
+    memset(e, 0, sizeof(*e));
+    e->role = role;
+    e->state = TE_START;
+    e->blksize = DATA_SIZE;
+    e->windowsize = 1;
+    e->rollover = rollover;
+    tftp_rtt_init(&e->rtt, INITIAL_RTO_US);
+}
+
+// RFC 2349 timeout: both the initial RTO and its ceiling
+void tftp_engine_set_timeout(tftp_engine_t *e, long long rto)
+{
+    tftp_rtt_init(&e->rtt, rto);
+    e->rtt.max = rto;
+}
+
+// Arms the retransmission timer after sending. Only a fresh packet starts
+// a round-trip measurement: the answer to a retransmission could belong to
+// either copy (Karn's algorithm).
+void tftp_engine_arm(tftp_engine_t *e, int fresh, long long now)
+{
+    e->sent_at = now;
+    e->timing = fresh;
+    e->deadline = now + e->rtt.rto;
+}
+
+// Called when the peer answers what we sent
+void tftp_engine_answered(tftp_engine_t *e, long long now)
+{
+    if (e->timing)
+        tftp_rtt_sample(&e->rtt, now - e->sent_at);
+    e->timing = 0;
+    e->retries = 0;
+}
+
+// Sender: starts a window right after the last acknowledged block, as
+// after ACK 0 or in place of waiting for it. Returns TE_SEND_DATA.
+int tftp_engine_begin(tftp_engine_t *e, long long now)
+{
+    e->state = TE_RUNNING;
+    e->next = e->block + 1;
+    tftp_engine_arm(e, 1, now);
+    return TE_SEND_DATA;
+}
+
+// Sender: back to waiting for ACK 0, for a new multicast master
+void tftp_engine_restart(tftp_engine_t *e)
+{
+    e->state = TE_START;
+    e->block = 0;
+    e->next = 1;
+    e->retries = 0;
+}
+
+// Sender. Anything outside (block, next) is a duplicate or stale ACK and
+// is ignored; the timer takes care of retransmissions.
+int tftp_engine_on_ack(tftp_engine_t *e, uint16_t wire, long long now)
+{
+    if (e->role != TE_SENDER || e->state == TE_FINISHED)
+        return 0;
+
+    uint64_t block = tftp_wire_to_block(wire, e->block, e->rollover);
+    if (e->relaxed)
+    {
+        // A multicast master may already hold blocks we have not sent it
+        // yet: it ACKs the end of what it has, from anywhere
+        if (block > e->last || (e->state != TE_START && block <= e->block))
+            return 0;
+    }
+    else if (e->state == TE_START ? block != 0 : block <= e->block || block >= e->next)
+    {
+        return 0;
+    }
+
+    e->block = block;
+    tftp_engine_answered(e, now);
+    if (block == e->last)
+    {
+        e->state = TE_FINISHED;
+        return TE_DONE;
+    }
+
+    // A full window was received, or the peer saw a gap and wants
+    // everything after block resent: either way a new window starts here
+    return tftp_engine_begin(e, now);
+}
+
+// Receiver. len is the payload length, which tells the last block.
+int tftp_engine_on_data(tftp_engine_t *e, uint16_t wire, size_t len, long long now)
+{
+    if (e->role != TE_RECEIVER || e->state == TE_FINISHED)
+        return 0;
+
+    uint64_t block = tftp_wire_to_block(wire, e->block, e->rollover);
+    if (e->state != TE_DALLY && block == e->block + 1)
+    {
+        e->state = TE_RUNNING;
+        e->block = block;
+        e->unacked++;
+        e->nak_sent = 0;
+        tftp_engine_answered(e, now);
+
+        if (len < (size_t)e->blksize)
+        {
+            e->state = TE_DALLY;
+            return TE_DELIVER | TE_LAST | TE_SEND_ACK;
+        }
+        if (e->unacked >= e->windowsize)
+            return TE_DELIVER | TE_SEND_ACK;
+
+        // The rest of the window is on its way
+        e->deadline = now + e->rtt.rto;
+        return TE_DELIVER;
+    }
+
+    if (e->state == TE_DALLY)
+    {
+        // Our final ACK was lost, repeat it
+        return block == e->block ? TE_SEND_ACK : 0;
+    }
+
+    // A jump ahead within the window means blocks were lost, anything else
+    // is a duplicate. Either way one ACK of the last in-order block gets
+    // the sender going again, but a duplicate is only answered while
+    // nothing new arrives, i.e. when our last ACK was probably lost: while
+    // a restarted window is under way, copies of blocks still in flight
+    // from before would each restart it again.
+    uint64_t ahead = block - e->block;
+    int gap = ahead > 1 && ahead <= (uint64_t)e->windowsize;
+    if (e->nak_sent || (!gap && e->unacked > 0))
+        return 0;
+    e->nak_sent = 1;
+    return TE_SEND_ACK;
+}
+
+// Called once the deadline has passed
+int tftp_engine_on_timeout(tftp_engine_t *e, long long now)
+{
+    if (e->state == TE_DALLY)
+    {
+        e->state = TE_FINISHED;
+        return TE_DONE;
+    }
+    if (e->role == TE_SENDER && e->state == TE_RUNNING && !tftp_engine_window_sent(e))
+    {
+        // Waiting on the caller to get the window out, not on the peer
+        e->deadline = now + e->rtt.rto;
+        return 0;
+    }
+
+    if (++e->retries > MAX_RETRIES)
+    {
+        e->state = TE_FINISHED;
+        return TE_FAIL;
+    }
+
+    tftp_rtt_backoff(&e->rtt);
+    if (e->state == TE_START)
+        return TE_RESEND; // the caller re-arms once it has resent
+    if (e->role == TE_RECEIVER)
+        return TE_SEND_ACK;
+
+    // Everything unacknowledged goes again
+    e->next = e->block + 1;
+    tftp_engine_arm(e, 0, now);
+    return TE_SEND_DATA;
+}
+
+uint64_t tftp_engine_window_end(tftp_engine_t *e)
+{
+    uint64_t end = e->block + e->windowsize;
+    return end < e->last ? end : e->last;
+}
+
+int tftp_engine_window_sent(tftp_engine_t *e)
+{
+    return e->next > e->block + e->windowsize || e->next > e->last;
+}
+
+// Sender: count more blocks of the window went out. A paced window may
+// take a while to leave: the retransmission timer (and the round trip
+// being timed) run from the last block.
+void tftp_engine_sent(tftp_engine_t *e, int count, long long now)
+{
+    e->next += count;
+    e->sent_at = now;
+    e->deadline = now + e->rtt.rto;
+}
+
+void tftp_engine_data_header(tftp_engine_t *e, uint64_t block, unsigned char *header)
+{
+    uint16_t wire = tftp_block_to_wire(block, e->rollover);
+    header[0] = 0;
+    header[1] = OP_DATA;
+    header[2] = wire >> 8;
+    header[3] = wire & 0xFF;
+}
+
+// Receiver: builds the ACK of the last block received in order into packet
+// (4 bytes) and arms the timer, or starts dallying after the final one
+size_t tftp_engine_ack(tftp_engine_t *e, unsigned char *packet, int fresh, long long now)
+{
+    uint16_t wire = tftp_block_to_wire(e->block, e->rollover);
+    packet[0] = 0;
+    packet[1] = OP_ACK;
+    packet[2] = wire >> 8;
+    packet[3] = wire & 0xFF;
+    e->unacked = 0;
+    tftp_engine_arm(e, fresh, now);
+    if (e->state == TE_DALLY)
+        e->deadline = now + DALLY_US;
+    return 4;
+}
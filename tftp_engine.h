@@ -0,0 +1,105 @@
+#ifndef TFTP_ENGINE_H
+#define TFTP_ENGINE_H
+
+// Transfer state machine shared by tftp_server, tftp_client and tftp_sim.
+// It never touches a socket, a file or the clock: the caller feeds it the
+// packets that arrive and the current time, and it answers with what has
+// to go out (TE_* actions) and when its timer expires (deadline). Option
+// negotiation, the request and the OACK, and reading and writing the file
+// stay with the caller.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DATA_SIZE 512
+
+#define OP_RRQ 1
+#define OP_WRQ 2
+#define OP_DATA 3
+#define OP_ACK 4
+#define OP_ERROR 5
+#define OP_OACK 6
+
+// Retransmission timer (RFC 6298 style, in microseconds). The RTO starts at
+// INITIAL_RTO_US until the first round trip is measured, doubles on every
+// consecutive expiry up to MAX_RTO_US, and a transfer is abandoned after
+// MAX_RETRIES expiries in a row, i.e. at most about half a minute. The side
+// that sends the final ACK lingers DALLY_US in case it is lost.
+#define INITIAL_RTO_US 1000000
+#define MIN_RTO_US 10000
+#define MAX_RTO_US 8000000
+#define MAX_RETRIES 6
+#define DALLY_US 1000000
+
+// Which way the DATA flows
+#define TE_SENDER 0   // RRQ on the server, WRQ on the client
+#define TE_RECEIVER 1 // WRQ on the server, RRQ on the client
+
+#define TE_START 0   // request or OACK sent, waiting for ACK 0 (sender) or DATA 1 (receiver)
+#define TE_RUNNING 1 // windows of DATA going one way, ACKs the other
+#define TE_DALLY 2   // receiver: final ACK sent, re-ACK a retransmitted last DATA
+#define TE_FINISHED 3
+
+// Actions, or'ed together in what the tftp_engine_on_* calls return
+#define TE_SEND_DATA 1 // sender: transmit blocks next to tftp_engine_window_end(), reporting them with tftp_engine_sent()
+#define TE_SEND_ACK 2  // receiver: acknowledge block with tftp_engine_ack()
+#define TE_RESEND 4    // repeat the request, OACK or ACK 0 that started the transfer
+#define TE_DELIVER 8   // receiver: the DATA payload is the next one in order
+#define TE_LAST 16     // receiver: and it was the final block
+#define TE_DONE 32     // finished, release the transfer
+#define TE_FAIL 64     // out of retries
+
+// Jacobson/Karels round-trip estimator
+typedef struct
+{
+    long long srtt;   // smoothed RTT, 0 until the first sample
+    long long rttvar; // smoothed mean deviation of the RTT
+    long long rto;
+    long long max; // ceiling for the RTO
+} tftp_rtt_t;
+
+typedef struct
+{
+    int role;
+    int state;
+    int blksize;
+    int windowsize;
+    int rollover; // value the block number wraps to after 65535
+    int relaxed;  // sender: take an ACK of any block up to last (multicast master)
+    uint64_t block; // sender: last block ACKed; receiver: last block received in order
+    uint64_t next;  // sender: next block of the current window to transmit
+    uint64_t last;  // sender: number of the final (short, maybe empty) block
+    int unacked;    // receiver: blocks received in order since our last ACK
+    int nak_sent;   // receiver: an early ACK already went out for the current gap
+    tftp_rtt_t rtt;
+    long long sent_at; // when the packet being timed was sent
+    int timing;        // a round trip is being timed (never across a retransmission)
+    int retries;
+    long long deadline;
+} tftp_engine_t;
+
+void tftp_rtt_init(tftp_rtt_t *r, long long rto);
+void tftp_rtt_sample(tftp_rtt_t *r, long long sample);
+void tftp_rtt_backoff(tftp_rtt_t *r);
+
+uint16_t tftp_block_to_wire(uint64_t block, int rollover);
+uint64_t tftp_wire_to_block(uint16_t wire, uint64_t base, int rollover);
+
+void tftp_engine_init(tftp_engine_t *e, int role, int rollover);
+void tftp_engine_set_timeout(tftp_engine_t *e, long long rto);
+void tftp_engine_arm(tftp_engine_t *e, int fresh, long long now);
+void tftp_engine_answered(tftp_engine_t *e, long long now);
+int tftp_engine_begin(tftp_engine_t *e, long long now);
+void tftp_engine_restart(tftp_engine_t *e);
+
+int tftp_engine_on_ack(tftp_engine_t *e, uint16_t wire, long long now);
+int tftp_engine_on_data(tftp_engine_t *e, uint16_t wire, size_t len, long long now);
+int tftp_engine_on_timeout(tftp_engine_t *e, long long now);
+
+uint64_t tftp_engine_window_end(tftp_engine_t *e);
+int tftp_engine_window_sent(tftp_engine_t *e);
+void tftp_engine_sent(tftp_engine_t *e, int count, long long now);
+void tftp_engine_data_header(tftp_engine_t *e, uint64_t block, unsigned char *header);
+size_t tftp_engine_ack(tftp_engine_t *e, unsigned char *packet, int fresh, long long now);
+
+#endif
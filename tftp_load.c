@@ -0,0 +1,625 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "tftp_engine.h"
+
+// Load generator: keeps up to -c RRQ/WRQ sessions running against a server
+// from one epoll loop, starting a new one as each finishes, until -n have
+// run. Each session is a tftp_engine with its own socket (TID). Downloads
+// are counted and discarded, uploads send a fixed pattern. The results go
+// to stdout, or to -o, as one JSON object.
+
+#define SERVER_PORT 8888
+#define BUF_SIZE 516
+#define MIN_BLKSIZE 8
+#define MAX_BLKSIZE 65464
+#define MAX_WINDOWSIZE 65535
+#define MIN_TIMEOUT 1
+#define MAX_TIMEOUT 255
+#define MAX_EVENTS 64
+#define MAX_MIX 64
+#define TIMER_SLACK_US 1000 // timers are checked at least this often
+
+// One entry of the -m mix: download a file, or upload size bytes
+typedef struct
+{
+    int opcode;
+    char *file;
+    long long size;
+    int weight;
+} mix_t;
+
+typedef struct
+{
+    int fd;
+    int slot;
+    mix_t *mix;
+    tftp_engine_t te;
+    int connected; // to the server's TID, once it answered
+    char request[BUF_SIZE];
+    int request_len;
+    long long started;
+    uint64_t bytes;
+    long long data_sent; // WRQ: DATA packets, retransmissions included
+    long long dups;      // RRQ: DATA that was not the next block
+    long long timeouts;
+} session_t;
+
+// Outcome of each session, by opcode
+typedef struct
+{
+    long long *elapsed; // of completed sessions, microseconds
+    int completed;
+    int failed;
+    uint64_t bytes;
+    long long retransmits;
+    long long timeouts;
+} stats_t;
+
+static struct sockaddr_in server;
+static int epfd;
+static int req_blksize, req_windowsize, req_timeout;
+static mix_t mix[MAX_MIX];
+static int nmix;
+static int mix_total;
+static uint64_t rng_state = 1;
+static unsigned char payload[MAX_BLKSIZE + 4];
+static stats_t stats[2]; // RRQ, WRQ
+
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// xorshift64*, seeded with -S
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static int append_option(char *buffer, int len, const char *name, long long value)
+{
+    if (len >= BUF_SIZE)
+        return len;
+    len += snprintf(buffer + len, BUF_SIZE - len, "%s%c%lld%c", name, 0, value, 0);
+    return len > BUF_SIZE ? BUF_SIZE : len;
+}
+
+// Parses "r:file[:weight]" or "w:bytes[:weight]" entries, comma separated
+static int parse_mix(char *spec)
+{
+    for (char *entry = strtok(spec, ","); entry; entry = strtok(NULL, ","))
+    {
+        if (nmix == MAX_MIX || (entry[0] != 'r' && entry[0] != 'w') || entry[1] != ':' || !entry[2])
+            return -1;
+
+        mix_t *m = &mix[nmix++];
+        m->opcode = entry[0] == 'r' ? OP_RRQ : OP_WRQ;
+        m->weight = 1;
+        char *weight = strrchr(entry + 2, ':');
+        if (weight)
+        {
+            *weight++ = '\0';
+            m->weight = atoi(weight);
+            if (m->weight < 1)
+                return -1;
+        }
+        if (m->opcode == OP_RRQ)
+        {
+            m->file = entry + 2;
+        }
+        else
+        {
+            m->size = atoll(entry + 2);
+            if (m->size < 0)
+                return -1;
+        }
+        mix_total += m->weight;
+    }
+    return nmix > 0 ? 0 : -1;
+}
+
+static mix_t *pick_mix(void)
+{
+    int n = rng_next() % mix_total;
+    for (int i = 0; i < nmix; i++)
+    {
+        n -= mix[i].weight;
+        if (n < 0)
+            return &mix[i];
+    }
+    return &mix[nmix - 1];
+}
+
+static void session_send(session_t *s, const void *buf, size_t len)
+{
+    // A full socket buffer counts as a loss; the timer recovers it
+    if (s->connected)
+        send(s->fd, buf, len, 0);
+    else
+        sendto(s->fd, buf, len, 0, (struct sockaddr *)&server, sizeof(server));
+}
+
+static void session_ack(session_t *s, int fresh)
+{
+    unsigned char packet[4];
+    size_t len = tftp_engine_ack(&s->te, packet, fresh, now_us());
+    session_send(s, packet, len);
+}
+
+static void session_send_window(session_t *s)
+{
+    uint64_t end = tftp_engine_window_end(&s->te);
+    uint64_t first = s->te.next;
+    for (uint64_t block = first; block <= end; block++)
+    {
+        size_t len = s->te.blksize;
+        if (block == s->te.last)
+            len = s->mix->size - (block - 1) * s->te.blksize;
+        tftp_engine_data_header(&s->te, block, payload);
+        session_send(s, payload, len + 4);
+        s->data_sent++;
+    }
+    tftp_engine_sent(&s->te, (int)(end - first + 1), now_us());
+}
+
+// Opens the session's socket and sends its request
+static int session_start(session_t *s, int slot)
+{
+    memset(s, 0, sizeof(*s));
+    s->slot = slot;
+    s->mix = pick_mix();
+    s->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (s->fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev) < 0)
+    {
+        perror("epoll_ctl");
+        close(s->fd);
+        return -1;
+    }
+
+    // Uploads reuse one name per slot, so a long run does not fill the
+    // server's directory
+    char name[64];
+    const char *file = s->mix->file;
+    if (s->mix->opcode == OP_WRQ)
+    {
+        snprintf(name, sizeof(name), "load-%d.bin", slot);
+        file = name;
+    }
+
+    int len = snprintf(s->request, BUF_SIZE, "%c%c%s%c%s%c", 0, s->mix->opcode, file, 0, "octet", 0);
+    if (req_blksize)
+        len = append_option(s->request, len, "blksize", req_blksize);
+    if (req_windowsize)
+        len = append_option(s->request, len, "windowsize", req_windowsize);
+    if (req_timeout)
+        len = append_option(s->request, len, "timeout", req_timeout);
+    if (s->mix->opcode == OP_WRQ)
+        len = append_option(s->request, len, "tsize", s->mix->size);
+    s->request_len = len > BUF_SIZE ? BUF_SIZE : len;
+
+    tftp_engine_init(&s->te, s->mix->opcode == OP_RRQ ? TE_RECEIVER : TE_SENDER, 0);
+    if (req_timeout)
+        tftp_engine_set_timeout(&s->te, req_timeout * 1000000LL);
+    s->te.last = s->mix->size / s->te.blksize + 1;
+
+    s->started = now_us();
+    session_send(s, s->request, s->request_len);
+    tftp_engine_arm(&s->te, 1, s->started);
+    return 0;
+}
+
+static void session_end(session_t *s, int ok)
+{
+    stats_t *st = &stats[s->mix->opcode == OP_RRQ ? 0 : 1];
+    if (ok)
+        st->elapsed[st->completed++] = now_us() - s->started;
+    else
+        st->failed++;
+    st->bytes += s->bytes;
+    st->timeouts += s->timeouts;
+    if (s->mix->opcode == OP_WRQ)
+    {
+        long long blocks = s->te.block;
+        st->retransmits += s->data_sent > blocks ? s->data_sent - blocks : 0;
+    }
+    else
+    {
+        st->retransmits += s->dups;
+    }
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    s->fd = -1;
+}
+
+// Takes the options the server acknowledged. Returns -1 on anything we
+// did not ask for.
+static int session_oack(session_t *s, unsigned char *buffer, ssize_t len)
+{
+    char *opt = (char *)buffer + 2;
+    char *end = (char *)buffer + len;
+
+    while (opt < end)
+    {
+        char *value = opt + strnlen(opt, end - opt) + 1;
+        if (value >= end)
+            return -1;
+
+        int granted = atoi(value);
+        if (strcasecmp(opt, "blksize") == 0 && req_blksize && granted >= MIN_BLKSIZE && granted <= req_blksize)
+            s->te.blksize = granted;
+        else if (strcasecmp(opt, "windowsize") == 0 && req_windowsize && granted >= 1 && granted <= req_windowsize)
+            s->te.windowsize = granted;
+        else if (strcasecmp(opt, "timeout") == 0 && granted == req_timeout)
+            ; // already in place
+        else if (strcasecmp(opt, "tsize") != 0)
+            return -1;
+
+        opt = value + strnlen(value, end - value) + 1;
+    }
+
+    s->te.last = s->mix->size / s->te.blksize + 1;
+    return 0;
+}
+
+// Returns 1 once the session is over
+static int session_on_packet(session_t *s, unsigned char *buffer, ssize_t n, struct sockaddr_in *from)
+{
+    if (n < 4)
+        return 0;
+    if (!s->connected)
+    {
+        // The first answer comes from the server's TID for this transfer
+        if (connect(s->fd, (struct sockaddr *)from, sizeof(*from)) == 0)
+            s->connected = 1;
+    }
+
+    long long now = now_us();
+    int opcode = buffer[1];
+    uint16_t wire = (buffer[2] << 8) | buffer[3];
+
+    if (opcode == OP_ERROR)
+    {
+        return 1;
+    }
+    if (opcode == OP_OACK && s->te.state == TE_START)
+    {
+        if (session_oack(s, buffer, n) < 0)
+            return 1;
+        tftp_engine_answered(&s->te, now);
+        if (s->mix->opcode == OP_RRQ)
+        {
+            session_ack(s, 1);
+        }
+        else
+        {
+            tftp_engine_begin(&s->te, now);
+            session_send_window(s);
+        }
+        return 0;
+    }
+
+    if (opcode == OP_DATA && s->mix->opcode == OP_RRQ)
+    {
+        int action = tftp_engine_on_data(&s->te, wire, n - 4, now);
+        if (action & TE_DELIVER)
+            s->bytes += n - 4;
+        else
+            s->dups++;
+        if (action & TE_SEND_ACK)
+            session_ack(s, 1);
+        return (action & TE_LAST) != 0;
+    }
+    if (opcode == OP_ACK && s->mix->opcode == OP_WRQ)
+    {
+        uint64_t before = s->te.block;
+        int action = tftp_engine_on_ack(&s->te, wire, now);
+        if (s->te.block > before)
+            s->bytes += (s->te.block - before) * s->te.blksize;
+        if (action & TE_DONE)
+        {
+            s->bytes = s->mix->size;
+            return 1;
+        }
+        if (action & TE_SEND_DATA)
+            session_send_window(s);
+    }
+    return 0;
+}
+
+// Returns 1 once the session gave up
+static int session_on_timeout(session_t *s)
+{
+    int action = tftp_engine_on_timeout(&s->te, now_us());
+    s->timeouts++;
+    if (action & TE_FAIL)
+        return 1;
+    if (action & TE_RESEND)
+    {
+        if (s->te.role == TE_RECEIVER && s->connected)
+            session_ack(s, 0); // ACK 0 of the OACK
+        else
+            session_send(s, s->request, s->request_len);
+        tftp_engine_arm(&s->te, 0, now_us());
+    }
+    else if (action & TE_SEND_ACK)
+    {
+        session_ack(s, 0);
+    }
+    else if (action & TE_SEND_DATA)
+    {
+        session_send_window(s);
+    }
+    return 0;
+}
+
+static int compare_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(long long *sorted, int n, int per_mille)
+{
+    if (n == 0)
+        return 0;
+    int i = (int)((long long)per_mille * n / 1000);
+    return sorted[i < n ? i : n - 1] / 1e3;
+}
+
+static void print_stats(FILE *out, const char *name, stats_t *st, double elapsed_s)
+{
+    qsort(st->elapsed, st->completed, sizeof(long long), compare_ll);
+    fprintf(out, "  \"%s\": {\"completed\": %d, \"failed\": %d, \"bytes\": %llu, \"throughput_Bps\": %.0f, "
+                 "\"retransmits\": %lld, \"timeouts\": %lld, "
+                 "\"completion_ms\": {\"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}}",
+            name, st->completed, st->failed, (unsigned long long)st->bytes, st->bytes / elapsed_s,
+            st->retransmits, st->timeouts,
+            percentile_ms(st->elapsed, st->completed, 500), percentile_ms(st->elapsed, st->completed, 990),
+            percentile_ms(st->elapsed, st->completed, 999), st->completed ? st->elapsed[st->completed - 1] / 1e3 : 0.0);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s -m mix [-c concurrent] [-n sessions] [-b blksize] [-w windowsize] [-t timeout] [-S seed] [-o file] <server_ip> [port]\n", prog);
+    fprintf(stderr, "  -m  sessions to run, picked at random by weight: comma separated\n");
+    fprintf(stderr, "      r:<file>[:weight] to download a file, w:<bytes>[:weight] to upload that much\n");
+    fprintf(stderr, "  -c  sessions running at once (default 100)\n");
+    fprintf(stderr, "  -n  sessions in total (default 1000)\n");
+    fprintf(stderr, "  -b  block size to request (RFC 2348)\n");
+    fprintf(stderr, "  -w  window size to request (RFC 7440)\n");
+    fprintf(stderr, "  -t  timeout in seconds to request (RFC 2349)\n");
+    fprintf(stderr, "  -S  seed for picking from the mix (default 1)\n");
+    fprintf(stderr, "  -o  write the JSON report here instead of stdout\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int concurrent = 100;
+    int total = 1000;
+    const char *out_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:c:n:b:w:t:S:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            if (parse_mix(optarg) < 0)
+                usage(argv[0]);
+            break;
+        case 'c':
+            concurrent = atoi(optarg);
+            if (concurrent < 1)
+                usage(argv[0]);
+            break;
+        case 'n':
+            total = atoi(optarg);
+            if (total < 1)
+                usage(argv[0]);
+            break;
+        case 'b':
+            req_blksize = atoi(optarg);
+            if (req_blksize < MIN_BLKSIZE || req_blksize > MAX_BLKSIZE)
+                usage(argv[0]);
+            break;
+        case 'w':
+            req_windowsize = atoi(optarg);
+            if (req_windowsize < 1 || req_windowsize > MAX_WINDOWSIZE)
+                usage(argv[0]);
+            break;
+        case 't':
+            req_timeout = atoi(optarg);
+            if (req_timeout < MIN_TIMEOUT || req_timeout > MAX_TIMEOUT)
+                usage(argv[0]);
+            break;
+        case 'S':
+            rng_state = strtoull(optarg, NULL, 0);
+            if (!rng_state)
+                rng_state = 1;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (nmix == 0 || argc - optind < 1 || argc - optind > 2)
+        usage(argv[0]);
+    if (concurrent > total)
+        concurrent = total;
+
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(argc - optind == 2 ? atoi(argv[optind + 1]) : SERVER_PORT);
+    if (inet_pton(AF_INET, argv[optind], &server.sin_addr) <= 0)
+    {
+        fprintf(stderr, "Invalid address %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    // One socket per session
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)concurrent + 16)
+    {
+        rl.rlim_cur = rl.rlim_max < (rlim_t)concurrent + 16 ? rl.rlim_max : (rlim_t)concurrent + 16;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    for (int i = 0; i < MAX_BLKSIZE; i++)
+        payload[4 + i] = i * 31 + 7;
+    stats[0].elapsed = malloc(total * sizeof(long long));
+    stats[1].elapsed = malloc(total * sizeof(long long));
+    session_t *sessions = calloc(concurrent, sizeof(session_t));
+    epfd = epoll_create1(0);
+    if (!stats[0].elapsed || !stats[1].elapsed || !sessions || epfd < 0)
+    {
+        perror("tftp_load");
+        exit(EXIT_FAILURE);
+    }
+
+    long long begin = now_us();
+    int started = 0;
+    int running = 0;
+    for (int i = 0; i < concurrent; i++)
+    {
+        if (session_start(&sessions[i], i) < 0)
+            exit(EXIT_FAILURE);
+        started++;
+        running++;
+    }
+
+    unsigned char buffer[MAX_BLKSIZE + 4];
+    struct epoll_event events[MAX_EVENTS];
+    long long next_timers = 0;
+    while (running > 0)
+    {
+        long long now = now_us();
+        int timeout = next_timers > now ? (int)((next_timers - now + 999) / 1000) : 0;
+        int nfds = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (nfds < 0 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < nfds; i++)
+        {
+            session_t *s = events[i].data.ptr;
+            while (s->fd >= 0)
+            {
+                struct sockaddr_in from;
+                socklen_t from_len = sizeof(from);
+                ssize_t n = recvfrom(s->fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&from, &from_len);
+                if (n < 0)
+                    break;
+                if (session_on_packet(s, buffer, n, &from))
+                {
+                    int ok = s->te.state == TE_DALLY || s->te.state == TE_FINISHED;
+                    session_end(s, ok && buffer[1] != OP_ERROR);
+                    running--;
+                    if (started < total && session_start(s, s->slot) == 0)
+                    {
+                        started++;
+                        running++;
+                    }
+                }
+            }
+        }
+
+        // Timers, checked on every pass that is late enough
+        now = now_us();
+        if (now < next_timers)
+            continue;
+        next_timers = now + TIMER_SLACK_US;
+        for (int i = 0; i < concurrent; i++)
+        {
+            session_t *s = &sessions[i];
+            if (s->fd < 0)
+                continue;
+            if (s->te.deadline <= now && session_on_timeout(s))
+            {
+                session_end(s, 0);
+                running--;
+                if (started < total && session_start(s, s->slot) == 0)
+                {
+                    started++;
+                    running++;
+                }
+                continue;
+            }
+            if (s->te.deadline < next_timers)
+                next_timers = s->te.deadline;
+        }
+    }
+
+    double elapsed_s = (now_us() - begin) / 1e6;
+    if (elapsed_s <= 0)
+        elapsed_s = 1e-6;
+
+    FILE *out = stdout;
+    if (out_path && !(out = fopen(out_path, "w")))
+    {
+        perror(out_path);
+        exit(EXIT_FAILURE);
+    }
+
+    stats_t all = {NULL, 0, 0, 0, 0, 0};
+    all.elapsed = malloc(total * sizeof(long long));
+    if (!all.elapsed)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int k = 0; k < 2; k++)
+    {
+        memcpy(all.elapsed + all.completed, stats[k].elapsed, stats[k].completed * sizeof(long long));
+        all.completed += stats[k].completed;
+        all.failed += stats[k].failed;
+        all.bytes += stats[k].bytes;
+        all.retransmits += stats[k].retransmits;
+        all.timeouts += stats[k].timeouts;
+    }
+
+    fprintf(out, "{\n  \"sessions\": %d, \"concurrent\": %d, \"blksize\": %d, \"windowsize\": %d, \"elapsed_s\": %.3f,\n",
+            started, concurrent, req_blksize ? req_blksize : DATA_SIZE, req_windowsize ? req_windowsize : 1, elapsed_s);
+    print_stats(out, "all", &all, elapsed_s);
+    fprintf(out, ",\n");
+    print_stats(out, "rrq", &stats[0], elapsed_s);
+    fprintf(out, ",\n");
+    print_stats(out, "wrq", &stats[1], elapsed_s);
+    fprintf(out, "\n}\n");
+    if (out != stdout)
+        fclose(out);
+
+    return all.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
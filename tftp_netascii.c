@@ -0,0 +1,180 @@
+#include <string.h>
+#include "tftp_netascii.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Ordinary text has a line ending every few dozen bytes and binary data
+// sent as netascii hardly any, so most of the time goes into finding the
+// next one. This looks at 16 bytes per step with SSE2 (always there on
+// x86-64), or 8 with plain 64-bit arithmetic elsewhere.
+
+#ifndef __SSE2__
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+// Nonzero if any byte of x is zero
+static uint64_t has_zero(uint64_t x)
+{
+    return (x - ONES) & ~x & HIGHS;
+}
+#endif
+
+size_t netascii_scan(const unsigned char *p, size_t len)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#else
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t x;
+        memcpy(&x, p + i, 8);
+        if (has_zero(x ^ ('\r' * ONES)) | has_zero(x ^ ('\n' * ONES)))
+            break; // found in these 8, the loop below says where
+    }
+#endif
+    for (; i < len; i++)
+    {
+        if (p[i] == '\r' || p[i] == '\n')
+            return i;
+    }
+    return len;
+}
+
+uint64_t netascii_encoded_size(const unsigned char *p, uint64_t len)
+{
+    uint64_t size = len;
+    uint64_t i = 0;
+#ifdef __SSE2__
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        size += __builtin_popcount(mask);
+    }
+#else
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t x;
+        memcpy(&x, p + i, 8);
+        if (!(has_zero(x ^ ('\r' * ONES)) | has_zero(x ^ ('\n' * ONES))))
+            continue;
+        for (int j = 0; j < 8; j++)
+            size += p[i + j] == '\r' || p[i + j] == '\n';
+    }
+#endif
+    for (; i < len; i++)
+        size += p[i] == '\r' || p[i] == '\n';
+    return size;
+}
+
+size_t netascii_encode(const unsigned char *src, uint64_t size, netascii_mark_t *m, unsigned char *out, size_t cap)
+{
+    size_t n = 0;
+    if (m->pending >= 0 && cap > 0)
+    {
+        out[n++] = m->pending;
+        m->pending = -1;
+    }
+
+    while (n < cap && m->pos < size)
+    {
+        // Copy up to the next byte that needs converting
+        size_t avail = cap - n;
+        if (avail > size - m->pos)
+            avail = size - m->pos;
+        size_t run = netascii_scan(src + m->pos, avail);
+        memcpy(out + n, src + m->pos, run);
+        n += run;
+        m->pos += run;
+        if (run == avail)
+            break;
+
+        int second = src[m->pos++] == '\n' ? '\n' : '\0';
+        out[n++] = '\r';
+        if (n < cap)
+            out[n++] = second;
+        else
+            m->pending = second;
+    }
+    return n;
+}
+
+const unsigned char *netascii_block(const unsigned char *src, uint64_t size, netascii_mark_t *m,
+                                    unsigned char *scratch, size_t cap, size_t *len)
+{
+    if (m->pending < 0)
+    {
+        size_t avail = cap;
+        if (avail > size - m->pos)
+            avail = size - m->pos;
+        if (netascii_scan(src + m->pos, avail) == avail)
+        {
+            const unsigned char *p = src + m->pos;
+            m->pos += avail;
+            *len = avail;
+            return p;
+        }
+    }
+    *len = netascii_encode(src, size, m, scratch, cap);
+    return scratch;
+}
+
+size_t netascii_decode(netascii_decoder_t *d, const unsigned char *in, size_t len, unsigned char *out)
+{
+    size_t n = 0;
+    size_t i = 0;
+
+    if (d->cr && len > 0)
+    {
+        // Finish the pair the previous block cut
+        d->cr = 0;
+        out[n++] = in[0] == '\n' ? '\n' : '\r';
+        if (in[0] == '\n' || in[0] == '\0')
+            i = 1;
+    }
+
+    while (i < len)
+    {
+        const unsigned char *cr = memchr(in + i, '\r', len - i);
+        size_t run = cr ? (size_t)(cr - (in + i)) : len - i;
+        memcpy(out + n, in + i, run);
+        n += run;
+        i += run;
+        if (!cr)
+            break;
+
+        if (++i == len)
+        {
+            d->cr = 1;
+            break;
+        }
+        // CR LF is a newline and CR NUL a carriage return. A bare CR is
+        // not valid netascii; it is kept, and what follows taken as is.
+        out[n++] = in[i] == '\n' ? '\n' : '\r';
+        if (in[i] == '\n' || in[i] == '\0')
+            i++;
+    }
+    return n;
+}
+
+size_t netascii_decode_end(netascii_decoder_t *d, unsigned char *out)
+{
+    if (!d->cr)
+        return 0;
+    d->cr = 0;
+    out[0] = '\r';
+    return 1;
+}
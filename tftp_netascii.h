@@ -0,0 +1,51 @@
+#ifndef TFTP_NETASCII_H
+#define TFTP_NETASCII_H
+
+// Netascii (RFC 764 line endings, as TFTP uses them) to and from the local
+// file format, one block at a time. On the wire a newline is CR LF and a
+// carriage return is CR NUL. Either pair may be cut by a block boundary,
+// so both directions carry state from one block to the next.
+//
+// The sender walks the file with a mark: where in the file the next block
+// starts, and the second byte of a pair the previous block could not fit.
+// Saving the mark of each block of a window is enough to regenerate any of
+// them for a retransmission.
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+    uint64_t pos; // in the file
+    int pending;  // second byte of a pair still to send, -1 if none
+} netascii_mark_t;
+
+typedef struct
+{
+    int cr; // the last block ended with a CR
+} netascii_decoder_t;
+
+// Offset of the first CR or LF in p, or len if there is none
+size_t netascii_scan(const unsigned char *p, size_t len);
+
+// Length of the file once converted to netascii
+uint64_t netascii_encoded_size(const unsigned char *p, uint64_t len);
+
+// Converts up to cap bytes' worth of the file, from the mark on, into out
+// and advances the mark. Returns the length produced, short only at the
+// end of the file.
+size_t netascii_encode(const unsigned char *src, uint64_t size, netascii_mark_t *m, unsigned char *out, size_t cap);
+
+// Same, but returns a pointer into src when the next cap bytes need no
+// conversion, and only uses scratch (cap bytes) otherwise
+const unsigned char *netascii_block(const unsigned char *src, uint64_t size, netascii_mark_t *m,
+                                    unsigned char *scratch, size_t cap, size_t *len);
+
+// Converts a block received in netascii back into out, which has room for
+// len + 1 bytes. Returns the length written.
+size_t netascii_decode(netascii_decoder_t *d, const unsigned char *in, size_t len, unsigned char *out);
+
+// After the last block: a lone CR at the very end is kept as it is
+size_t netascii_decode_end(netascii_decoder_t *d, unsigned char *out);
+
+#endif
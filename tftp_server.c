@@ -1,209 +1,2101 @@
+#define _GNU_SOURCE // sendmmsg, recvmmsg, pthread_setaffinity_np
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/uio.h>
+#include "tftp_engine.h"
+#include "tftp_netascii.h"
 
 #define SERVER_PORT 8888
 #define BUF_SIZE 516
-#define DATA_SIZE 512
 
-#define OP_RRQ 1
-#define OP_WRQ 2
-#define OP_DATA 3
-#define OP_ACK 4
-#define OP_ERROR 5
+// RFC 2348 block size limits and the IPv4 + UDP + TFTP header overhead
+#define MIN_BLKSIZE 8
+#define MAX_BLKSIZE 65464
+#define PKT_OVERHEAD 32
 
+// RFC 7440 window size limits; a window of 1 is plain lock-step TFTP
+#define MAX_WINDOWSIZE 65535
+#define DEFAULT_MAX_WINDOWSIZE 64
+
+// Block numbers are 16 bits on the wire. Past 65535 they wrap to 0 or to 1,
+// as agreed with the "rollover" option or set with -r on the server.
+#define ROLLOVER_UNSET -1
+
+// RFC 2090 multicast: sessions get consecutive groups starting at the -M
+// address and send DATA to this port. Block numbers never wrap within a
+// session (clients joining late could not tell which wrap they are in), so
+// larger files are served unicast.
+#define MCAST_PORT 1758
+#define MCAST_GROUPS 256
+#define MCAST_MAX_BLOCKS 65535
+
+#define ERR_UNDEFINED 0
 #define ERR_NOT_FOUND 1
 #define ERR_ACCESS_VIOLATION 2
+#define ERR_DISK_FULL 3
 #define ERR_ILLEGAL_OPERATION 4
+#define ERR_UNKNOWN_TID 5
+#define ERR_OPTION 8
+
+#define MAX_EVENTS 64
+
+// Syscall batching. A window of DATA goes out with one sendmmsg of up to
+// TX_BATCH datagrams, and with UDP GSO each of those carries up to
+// GSO_MAX_SEGMENTS blocks that the kernel splits at blksize + 4. Incoming
+// packets are read with recvmmsg, up to RX_BATCH per call.
+#define TX_BATCH 64
+#define TX_MAX_BLOCKS 1024
+#define GSO_MAX_SEGMENTS 64
+#define GSO_MAX_BYTES 65000
+#define RX_BATCH 64
+#define RX_BATCH_BYTES (256 * 1024)
+
+// Netascii blocks that need converting are built in a scratch buffer of
+// this size, which bounds a batch; the others go out from the mapping
+#define TX_ASCII_BYTES (1024 * 1024)
+
+// A client negotiating the RFC 2349 timeout (MIN_TIMEOUT to MAX_TIMEOUT
+// seconds) gets it as both the initial RTO and the cap, see tftp_engine.h
+#define MIN_TIMEOUT 1
+#define MAX_TIMEOUT 255
+
+// Hot-file cache: files served by RRQ stay mapped while they are in use
+// and, unreferenced, until the mapped total exceeds the budget (-c)
+#define CACHE_BUCKETS 256
+#define DEFAULT_CACHE_MB 1024
+
+// WRQ write-behind: received blocks are gathered into WB_CHUNK buffers
+// (aligned, and at aligned file offsets) that a writer thread flushes. A
+// transfer stops ACKing while WB_MAX_PENDING of its chunks are queued, so
+// slow storage holds the client back instead of eating memory.
+#define WB_CHUNK (1024 * 1024)
+#define WB_ALIGN 4096
+#define WB_MAX_PENDING 4
+
+// DATA scheduler: transfers with blocks to send are served deficit round
+// robin, SCHED_QUANTUM bytes each per round, so a small file is not stuck
+// behind a large one. Optional token buckets cap the total rate (-B, split
+// evenly between workers) and each transfer's rate (-P); they hold at most
+// SCHED_BURST_US worth of tokens, which paces DATA in short bursts.
+#define SCHED_QUANTUM 65536
+#define SCHED_BURST_US 5000
+
+// Options requested in a RRQ/WRQ; 0 means the option was not sent
+typedef struct
+{
+    int blksize;
+    int windowsize;
+    int rollover; // ROLLOVER_UNSET when not sent
+    int multicast;
+    long long tsize; // -1 when not sent
+    int timeout;     // seconds
+} options_t;
+
+// A client of a multicast session
+typedef struct mc_member
+{
+    struct sockaddr_in addr;
+    options_t opts; // as requested, echoed back in its OACKs
+    int windowsize; // granted, used while the client is the master
+    struct mc_member *next;
+} mc_member_t;
+
+// RFC 2090 session. DATA goes to the group; only the master client ACKs,
+// and the transfer socket is connected to it. The others listen passively
+// and take their turn as master, in order of arrival, once the current one
+// is done, asking then for the blocks they missed. A client may join from
+// any worker, so members and the session list are guarded by mcast_lock.
+typedef struct mcast
+{
+    struct sockaddr_in group;
+    mc_member_t *master;
+    mc_member_t *waiting;
+    struct transfer *transfer; // owned by the worker that started the session
+    struct mcast *next;
+} mcast_t;
+
+// Read-only mapping of a file, shared by every RRQ that serves it. An
+// entry is identified by path and validated against the inode and mtime on
+// each lookup; a file replaced on disk gets a new entry while transfers
+// still using the old one keep it until they finish. Truncating a file in
+// place while it is being served is not supported (the mapping would fault).
+typedef struct cached_file
+{
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    off_t ascii_size;    // converted to netascii, -1 until a netascii RRQ needs it
+    unsigned char *data; // NULL for an empty file
+    int refcnt;
+    int stale; // no longer in the hash table, freed by the last release
+    long long last_used;
+    struct cached_file *next;
+} cached_file_t;
+
+typedef struct
+{
+    cached_file_t *buckets[CACHE_BUCKETS];
+    size_t mapped; // bytes mapped by entries still in the table
+    size_t budget;
+    pthread_mutex_t lock; // shared by all workers
+} file_cache_t;
+
+// Token bucket, in bytes on the wire
+typedef struct
+{
+    long long tokens;
+    long long at; // last refill
+} bucket_t;
+
+// One RRQ or WRQ in progress. Each transfer owns a socket bound to an
+// ephemeral port (its TID) and connected to the client's TID, so the kernel
+// only hands it packets that belong to this transfer. Block numbers, the
+// window and the retransmission timer are kept by its engine.
+typedef struct transfer
+{
+    int sockfd;
+    int fd;              // WRQ: temporary file being written
+    char *path;          // WRQ: name the upload gets once complete
+    char *temp_path;     // WRQ: where it is written until then
+    unsigned char *wb_buf; // WRQ: chunk being filled, NULL until needed
+    size_t wb_len;
+    int wb_pending;      // WRQ: chunks queued to the writer thread
+    int ack_deferred;    // WRQ: an ACK waits for the writer to catch up
+    int wb_error;        // WRQ: errno of a failed write, 0 if none
+    cached_file_t *file; // RRQ: file being served
+    int netascii;        // transferred in netascii mode
+    netascii_mark_t *marks; // RRQ netascii: where each block of the window starts, by block % (windowsize + 1)
+    netascii_decoder_t nad; // WRQ netascii
+    mcast_t *mc;         // RRQ: multicast session, NULL for unicast
+    int opcode;
+    tftp_engine_t te;    // sender for a RRQ, receiver for a WRQ
+    int commit;          // WRQ: last DATA received, final ACK waits for the disk
+    struct sockaddr_in peer;
+    uint64_t offset;     // WRQ: bytes received so far
+    int want_write; // EPOLLOUT armed because the socket buffer was full
+    int gso;        // RRQ: may coalesce blocks with UDP_SEGMENT
+    int ready;      // RRQ: queued in the DATA scheduler
+    long long deficit; // RRQ: bytes it may still send this round
+    bucket_t bucket;   // RRQ: its own rate limit
+    struct transfer *ready_next;
+    char *packet;   // last OACK/ACK sent, or scratch space for DATA
+    size_t packet_len;
+    struct transfer *next;
+} transfer_t;
+
+typedef struct
+{
+    int epfd;
+    int listenfd;
+    struct sockaddr_in addr;
+    int max_blksize;
+    int pmtu_cap; // also cap blksize at the path MTU towards the client
+    int max_windowsize;
+    int rollover; // wrap-around value used when the client does not ask
+    int gso;      // the kernel supports UDP_SEGMENT
+    struct in_addr mcast_base; // first multicast group, INADDR_ANY if disabled
+    file_cache_t *cache;       // shared by all workers
+    int cpu;                   // core the worker is pinned to, -1 for none
+    transfer_t *transfers;
+    int active;
+    long long rate;        // bytes/s for this worker, 0 for no limit
+    long long client_rate; // bytes/s per transfer, 0 for no limit
+    bucket_t bucket;
+    transfer_t *ready;     // DATA scheduler queue
+    transfer_t *ready_tail;
+    pthread_t thread;
+    int wb_efd;                // eventfd the writer thread signals
+    pthread_mutex_t wb_lock;
+    struct wb_job *wb_done;    // flushed chunks to hand back to transfers
+} server_t;
+
+// A chunk queued for the writer thread
+typedef struct wb_job
+{
+    transfer_t *t;
+    server_t *srv; // worker to return it to
+    int fd;
+    unsigned char *buf;
+    size_t len;
+    off_t offset;
+    int last; // sync the file once written
+    int err;
+    struct wb_job *next;
+} wb_job_t;
+
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_cond = PTHREAD_COND_INITIALIZER;
+static wb_job_t *wb_queue;
+static wb_job_t **wb_tail = &wb_queue;
+static mode_t file_mode; // for uploads: 0666 less the umask
+
+static pthread_mutex_t mcast_lock = PTHREAD_MUTEX_INITIALIZER;
+static mcast_t *mcast_sessions;
+static unsigned int mcast_next; // group offset for the next session
+
+// Receive slots for recvmmsg, sized per call to what the socket can carry,
+// one set per worker thread
+static __thread unsigned char rx_buffer[RX_BATCH_BYTES];
+static __thread struct iovec rx_iov[RX_BATCH];
+static __thread struct mmsghdr rx_msgs[RX_BATCH];
+static __thread struct sockaddr_in rx_addrs[RX_BATCH];
+
+// Transmit batch for rrq_pump: a header and a pointer into the mapped file
+// per block, and the UDP_SEGMENT control message of each datagram
+static __thread unsigned char tx_headers[TX_MAX_BLOCKS][4];
+static __thread struct iovec tx_iov[TX_MAX_BLOCKS * 2];
+static __thread struct mmsghdr tx_msgs[TX_BATCH];
+static __thread int tx_blocks[TX_BATCH];
+static __thread union
+{
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+} tx_control[TX_BATCH];
+static __thread unsigned char tx_ascii[TX_ASCII_BYTES];
+
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Grows both socket buffers to at least bytes (the kernel clamps this to
+// net.core.[rw]mem_max), never shrinking the defaults
+static void grow_socket_buffers(int sockfd, int bytes)
+{
+    int cur;
+    socklen_t len = sizeof(cur);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &cur, &len) == 0 && cur >= bytes)
+        return;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes));
+}
+
+void send_error(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, int error_code, const char *error_msg)
+{
+    char buffer[BUF_SIZE];
+    int msg_len = snprintf(buffer, BUF_SIZE, "%c%c%c%c%s%c", 0, OP_ERROR, 0, error_code, error_msg, 0);
+    sendto(sockfd, buffer, msg_len, 0, (struct sockaddr *)client_addr, client_len);
+}
+
+static unsigned int hash_path(const char *path)
+{
+    unsigned int h = 2166136261u; // FNV-1a
+    while (*path)
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    return h % CACHE_BUCKETS;
+}
+
+static void cache_entry_free(cached_file_t *f)
+{
+    if (f->data)
+        munmap(f->data, f->size);
+    free(f->path);
+    free(f);
+}
+
+// Takes an entry out of the table; it is freed now or by its last user
+static void cache_unlink(file_cache_t *cache, cached_file_t **pp)
+{
+    cached_file_t *f = *pp;
+    *pp = f->next;
+    cache->mapped -= f->size;
+    f->stale = 1;
+    if (f->refcnt == 0)
+        cache_entry_free(f);
+}
+
+// Unmaps the least recently used idle files until the budget is met
+static void cache_trim(file_cache_t *cache)
+{
+    while (cache->mapped > cache->budget)
+    {
+        cached_file_t **victim = NULL;
+        for (int i = 0; i < CACHE_BUCKETS; i++)
+        {
+            for (cached_file_t **pp = &cache->buckets[i]; *pp; pp = &(*pp)->next)
+            {
+                if ((*pp)->refcnt == 0 && (!victim || (*pp)->last_used < (*victim)->last_used))
+                    victim = pp;
+            }
+        }
+        if (!victim)
+            return; // everything is in use
+        cache_unlink(cache, victim);
+    }
+}
+
+// Returns a referenced mapping of path, or NULL with errno set. Called
+// with the cache locked.
+static cached_file_t *cache_lookup(file_cache_t *cache, const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) < 0)
+        return NULL;
+    if (!S_ISREG(st.st_mode))
+    {
+        errno = EACCES;
+        return NULL;
+    }
+
+    cached_file_t **pp = &cache->buckets[hash_path(path)];
+    while (*pp)
+    {
+        cached_file_t *f = *pp;
+        if (strcmp(f->path, path) != 0)
+        {
+            pp = &f->next;
+            continue;
+        }
+
+        if (f->dev == st.st_dev && f->ino == st.st_ino && f->size == st.st_size &&
+            f->mtime.tv_sec == st.st_mtim.tv_sec && f->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        {
+            f->refcnt++;
+            f->last_used = now_us();
+            return f;
+        }
+
+        // Changed on disk since it was mapped
+        cache_unlink(cache, pp);
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    cached_file_t *f = calloc(1, sizeof(cached_file_t));
+    if (!f || !(f->path = strdup(path)))
+    {
+        free(f);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->mtime = st.st_mtim;
+    f->size = st.st_size;
+    f->ascii_size = -1;
+
+    if (f->size > 0)
+    {
+        f->data = mmap(NULL, f->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (f->data == MAP_FAILED)
+        {
+            int err = errno;
+            close(fd);
+            free(f->path);
+            free(f);
+            errno = err;
+            return NULL;
+        }
+        madvise(f->data, f->size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    f->refcnt = 1;
+    f->last_used = now_us();
+    f->next = cache->buckets[hash_path(path)];
+    cache->buckets[hash_path(path)] = f;
+    cache->mapped += f->size;
+    cache_trim(cache);
+    return f;
+}
+
+static cached_file_t *cache_acquire(file_cache_t *cache, const char *path)
+{
+    pthread_mutex_lock(&cache->lock);
+    cached_file_t *f = cache_lookup(cache, path);
+    int err = errno;
+    pthread_mutex_unlock(&cache->lock);
+    errno = err;
+    return f;
+}
+
+static void cache_release(file_cache_t *cache, cached_file_t *f)
+{
+    pthread_mutex_lock(&cache->lock);
+    if (--f->refcnt == 0 && f->stale)
+        cache_entry_free(f);
+    cache_trim(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Length of a referenced file in netascii, counted on first use and kept
+// with the mapping. The count runs outside the lock; two workers racing
+// on it just both store the same value.
+static off_t cache_ascii_size(file_cache_t *cache, cached_file_t *f)
+{
+    pthread_mutex_lock(&cache->lock);
+    off_t size = f->ascii_size;
+    pthread_mutex_unlock(&cache->lock);
+    if (size >= 0)
+        return size;
+
+    size = netascii_encoded_size(f->data, f->size);
+    pthread_mutex_lock(&cache->lock);
+    f->ascii_size = size;
+    pthread_mutex_unlock(&cache->lock);
+    return size;
+}
+
+// Sends the OACK/ACK stored in the transfer and arms its retransmission timer
+static void transfer_send(transfer_t *t, int fresh)
+{
+    if (send(t->sockfd, t->packet, t->packet_len, 0) < 0 && errno != EAGAIN)
+        perror("send");
+    tftp_engine_arm(&t->te, fresh, now_us());
+}
+
+static void transfer_set_writable(server_t *srv, transfer_t *t, int want_write)
+{
+    if (t->want_write == want_write)
+        return;
+
+    struct epoll_event ev;
+    ev.events = want_write ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.ptr = t;
+    epoll_ctl(srv->epfd, EPOLL_CTL_MOD, t->sockfd, &ev);
+    t->want_write = want_write;
+}
+
+static long long bucket_burst(long long rate)
+{
+    long long burst = rate * SCHED_BURST_US / 1000000;
+    return burst > SCHED_QUANTUM ? burst : SCHED_QUANTUM;
+}
+
+static void bucket_refill(bucket_t *b, long long rate, long long now)
+{
+    b->tokens += rate * (now - b->at) / 1000000;
+    if (b->tokens > bucket_burst(rate))
+        b->tokens = bucket_burst(rate);
+    b->at = now;
+}
+
+// Microseconds until the bucket holds need bytes
+static long long bucket_wait(bucket_t *b, long long rate, long long need)
+{
+    return b->tokens >= need ? 0 : (need - b->tokens) * 1000000 / rate + 1;
+}
+
+// Queues a transfer that has DATA to send; sched_run sends it
+static void sched_wake(server_t *srv, transfer_t *t)
+{
+    if (t->ready || t->want_write)
+        return;
+    t->ready = 1;
+    t->ready_next = NULL;
+    if (srv->ready)
+        srv->ready_tail->ready_next = t;
+    else
+        srv->ready = t;
+    srv->ready_tail = t;
+}
+
+static transfer_t *sched_pop(server_t *srv)
+{
+    transfer_t *t = srv->ready;
+    srv->ready = t->ready_next;
+    t->ready = 0;
+    return t;
+}
+
+static void sched_remove(server_t *srv, transfer_t *t)
+{
+    transfer_t *prev = NULL;
+    for (transfer_t *q = srv->ready; q; prev = q, q = q->ready_next)
+    {
+        if (q != t)
+            continue;
+        if (prev)
+            prev->ready_next = t->ready_next;
+        else
+            srv->ready = t->ready_next;
+        if (srv->ready_tail == t)
+            srv->ready_tail = prev;
+        t->ready = 0;
+        return;
+    }
+}
+
+// Bytes the transfer may put on the wire right now
+static long long sched_budget(server_t *srv, transfer_t *t)
+{
+    long long budget = t->deficit;
+    if (srv->rate && srv->bucket.tokens < budget)
+        budget = srv->bucket.tokens;
+    if (srv->client_rate && t->bucket.tokens < budget)
+        budget = t->bucket.tokens;
+    return budget;
+}
+
+// Takes a session off the list new clients can join. Called with
+// mcast_lock held.
+static void mcast_unregister(mcast_t *mc)
+{
+    for (mcast_t **pp = &mcast_sessions; *pp; pp = &(*pp)->next)
+    {
+        if (*pp == mc)
+        {
+            *pp = mc->next;
+            return;
+        }
+    }
+}
+
+static void transfer_free(server_t *srv, transfer_t *t)
+{
+    // A request on another worker may be joining the session: take it off
+    // the list before its socket and file go away
+    if (t->mc)
+    {
+        pthread_mutex_lock(&mcast_lock);
+        mcast_unregister(t->mc);
+        mc_member_t *waiting = t->mc->waiting;
+        t->mc->waiting = NULL;
+        pthread_mutex_unlock(&mcast_lock);
+
+        while (waiting)
+        {
+            mc_member_t *m = waiting;
+            waiting = m->next;
+            free(m);
+        }
+        free(t->mc->master);
+        free(t->mc);
+        t->mc = NULL;
+    }
+
+    transfer_t **pp = &srv->transfers;
+    while (*pp && *pp != t)
+        pp = &(*pp)->next;
+    if (*pp)
+        *pp = t->next;
+
+    if (t->ready)
+        sched_remove(srv, t);
+    if (t->sockfd >= 0)
+    {
+        epoll_ctl(srv->epfd, EPOLL_CTL_DEL, t->sockfd, NULL);
+        close(t->sockfd);
+        t->sockfd = -1;
+        srv->active--;
+    }
+    if (t->wb_pending > 0)
+        return; // finished by wb_on_done once the writer lets go of it
+
+    if (t->fd >= 0)
+        close(t->fd);
+    if (t->temp_path)
+        unlink(t->temp_path); // upload never completed
+    free(t->temp_path);
+    free(t->path);
+    free(t->wb_buf);
+    if (t->file)
+        cache_release(srv->cache, t->file);
+    free(t->marks);
+    free(t->packet);
+    free(t);
+}
+
+static void transfer_fail(server_t *srv, transfer_t *t, int error_code, const char *error_msg)
+{
+    send_error(t->sockfd, &t->peer, sizeof(t->peer), error_code, error_msg);
+    transfer_free(srv, t);
+}
+
+// Creates the transfer and its TID socket, but does not send anything yet
+static transfer_t *transfer_new(server_t *srv, struct sockaddr_in *client_addr, int opcode)
+{
+    transfer_t *t = calloc(1, sizeof(transfer_t));
+    if (!t)
+    {
+        perror("calloc");
+        return NULL;
+    }
+    t->fd = -1;
+    t->opcode = opcode;
+    t->peer = *client_addr;
+    tftp_engine_init(&t->te, opcode == OP_RRQ ? TE_SENDER : TE_RECEIVER, srv->rollover);
+    t->gso = 1;
+
+    t->packet = malloc(BUF_SIZE);
+    t->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (!t->packet || t->sockfd < 0)
+    {
+        perror("transfer_new");
+        if (t->sockfd >= 0)
+            close(t->sockfd);
+        free(t->packet);
+        free(t);
+        return NULL;
+    }
+
+    struct sockaddr_in local = srv->addr;
+    local.sin_port = 0;
+    if (bind(t->sockfd, (struct sockaddr *)&local, sizeof(local)) < 0 ||
+        connect(t->sockfd, (struct sockaddr *)client_addr, sizeof(*client_addr)) < 0 ||
+        set_nonblocking(t->sockfd) < 0)
+    {
+        perror("transfer socket");
+        close(t->sockfd);
+        free(t->packet);
+        free(t);
+        return NULL;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = t;
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, t->sockfd, &ev) < 0)
+    {
+        perror("epoll_ctl");
+        close(t->sockfd);
+        free(t->packet);
+        free(t);
+        return NULL;
+    }
+
+    t->next = srv->transfers;
+    srv->transfers = t;
+    srv->active++;
+    return t;
+}
+
+// Transmits what is left of the current window, from next_block up to
+// block_num + windowsize, straight from the cached mapping, as far as the
+// scheduler allows. In netascii, blocks that need converting are built in
+// tx_ascii instead. Stops early and waits for EPOLLOUT when the socket
+// buffer is full. Returns -1 if the transfer was released.
+static int rrq_pump(server_t *srv, transfer_t *t)
+{
+    long long wire = t->te.blksize + 4 + PKT_OVERHEAD;
+    off_t size = t->marks ? t->file->ascii_size : t->file->size;
+    int ring = t->te.windowsize + 1;
+
+    while (!tftp_engine_window_sent(&t->te))
+    {
+        long long budget = sched_budget(srv, t);
+        if (budget < wire)
+            return 0; // the scheduler comes back to it
+
+        uint64_t end = tftp_engine_window_end(&t->te);
+        if (end > t->te.next + budget / wire - 1)
+            end = t->te.next + budget / wire - 1;
+
+        // Every block but the last is exactly blksize, so consecutive
+        // blocks can share a datagram that GSO cuts at blksize + 4
+        int per_msg = 1;
+        if (srv->gso && t->gso)
+        {
+            per_msg = GSO_MAX_BYTES / (t->te.blksize + 4);
+            if (per_msg > GSO_MAX_SEGMENTS)
+                per_msg = GSO_MAX_SEGMENTS;
+            if (per_msg < 1)
+                per_msg = 1;
+        }
+
+        int nmsgs = 0;
+        int nblocks = 0;
+        size_t ascii_used = 0;
+        uint64_t block = t->te.next;
+        while (block <= end && nmsgs < TX_BATCH && nblocks + per_msg <= TX_MAX_BLOCKS &&
+               (!t->marks || ascii_used + (size_t)per_msg * t->te.blksize <= TX_ASCII_BYTES))
+        {
+            struct msghdr *msg = &tx_msgs[nmsgs].msg_hdr;
+            memset(msg, 0, sizeof(*msg));
+            msg->msg_iov = &tx_iov[nblocks * 2];
+            if (t->mc)
+            {
+                // Overrides the master the socket is connected to
+                msg->msg_name = &t->mc->group;
+                msg->msg_namelen = sizeof(t->mc->group);
+            }
+
+            int count = 0;
+            for (; count < per_msg && block <= end; count++, block++, nblocks++)
+            {
+                uint64_t offset = (block - 1) * t->te.blksize;
+                size_t len = block == t->te.last ? size - offset : (size_t)t->te.blksize;
+                const unsigned char *data = len ? t->file->data + offset : NULL;
+                if (t->marks && len)
+                {
+                    // Converted from where the block starts in the file,
+                    // leaving where the next one does for a retransmission
+                    netascii_mark_t m = t->marks[block % ring];
+                    data = netascii_block(t->file->data, t->file->size, &m, tx_ascii + ascii_used, len, &len);
+                    if (data == tx_ascii + ascii_used)
+                        ascii_used += len;
+                    t->marks[(block + 1) % ring] = m;
+                }
+
+                unsigned char *header = tx_headers[nblocks];
+                tftp_engine_data_header(&t->te, block, header);
+
+                // The header and the mapped file pages go out as they are,
+                // without copying the block into a packet buffer first
+                tx_iov[nblocks * 2].iov_base = header;
+                tx_iov[nblocks * 2].iov_len = 4;
+                tx_iov[nblocks * 2 + 1].iov_base = (void *)data;
+                tx_iov[nblocks * 2 + 1].iov_len = len;
+            }
+            msg->msg_iovlen = count * 2;
+
+            if (count > 1)
+            {
+                msg->msg_control = tx_control[nmsgs].buf;
+                msg->msg_controllen = sizeof(tx_control[nmsgs].buf);
+                struct cmsghdr *cm = CMSG_FIRSTHDR(msg);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t segment = t->te.blksize + 4;
+                memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+            }
+            tx_blocks[nmsgs++] = count;
+        }
+
+        int sent = sendmmsg(t->sockfd, tx_msgs, nmsgs, 0);
+        if (sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                transfer_set_writable(srv, t, 1);
+                return 0;
+            }
+            if ((errno == EINVAL || errno == EIO) && per_msg > 1)
+            {
+                // Segments larger than the route MTU, or a device that
+                // cannot checksum them: send this client one block a time
+                t->gso = 0;
+                continue;
+            }
+            // e.g. ECONNREFUSED: the client went away
+            perror("sendmmsg");
+            transfer_free(srv, t);
+            return -1;
+        }
+
+        int blocks = 0;
+        for (int i = 0; i < sent; i++)
+            blocks += tx_blocks[i];
+        tftp_engine_sent(&t->te, blocks, now_us());
+        t->deficit -= blocks * wire;
+        srv->bucket.tokens -= blocks * wire;
+        t->bucket.tokens -= blocks * wire;
+    }
+
+    transfer_set_writable(srv, t, 0);
+    return 0;
+}
+
+// Runs deficit round robin over the transfers with DATA to send, within
+// the rate limits. Returns how many microseconds until it has to run
+// again, or -1 if nothing is waiting for tokens.
+static long long sched_run(server_t *srv)
+{
+    long long now = now_us();
+    long long wait = -1;
+    if (srv->rate)
+        bucket_refill(&srv->bucket, srv->rate, now);
+
+    int progress = 1;
+    while (srv->ready && progress)
+    {
+        progress = 0;
+
+        // One round: every transfer queued at its start gets a turn
+        transfer_t *last = srv->ready_tail;
+        int done = 0;
+        while (!done && srv->ready)
+        {
+            transfer_t *t = sched_pop(srv);
+            done = t == last;
+            long long wire = t->te.blksize + 4 + PKT_OVERHEAD;
+
+            if (srv->client_rate)
+            {
+                bucket_refill(&t->bucket, srv->client_rate, now);
+                if (t->bucket.tokens < wire)
+                {
+                    long long w = bucket_wait(&t->bucket, srv->client_rate, wire);
+                    if (wait < 0 || w < wait)
+                        wait = w;
+                    sched_wake(srv, t);
+                    continue;
+                }
+            }
+
+            // The deficit only carries over while the transfer is held
+            // back by the round, not while it waits for tokens
+            t->deficit += SCHED_QUANTUM;
+            if (t->deficit > SCHED_QUANTUM + wire)
+                t->deficit = SCHED_QUANTUM + wire;
+
+            uint64_t before = t->te.next;
+            if (rrq_pump(srv, t) < 0)
+            {
+                progress = 1;
+                continue;
+            }
+            if (t->te.next != before)
+                progress = 1;
+
+            if (tftp_engine_window_sent(&t->te) || t->want_write)
+                t->deficit = 0;
+            else
+                sched_wake(srv, t);
+
+            if (srv->rate && srv->bucket.tokens < SCHED_QUANTUM)
+            {
+                // Out of tokens for everyone
+                long long w = bucket_wait(&srv->bucket, srv->rate, SCHED_QUANTUM);
+                return wait < 0 || w < wait ? w : wait;
+            }
+        }
+    }
+    return srv->ready ? (wait < 0 ? 0 : wait) : wait;
+}
+
+static void wrq_send_ack(transfer_t *t, int fresh)
+{
+    t->packet_len = tftp_engine_ack(&t->te, (unsigned char *)t->packet, fresh, now_us());
+    if (send(t->sockfd, t->packet, t->packet_len, 0) < 0 && errno != EAGAIN)
+        perror("send");
+}
+
+// Parses the option/value pairs that follow the mode in a request.
+// Unknown options are ignored, as RFC 2347 requires.
+static void parse_options(char *opt, char *end, options_t *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->rollover = ROLLOVER_UNSET;
+    opts->tsize = -1;
+
+    while (opt < end)
+    {
+        char *value = opt + strlen(opt) + 1;
+        if (value >= end)
+            break;
+
+        if (strcasecmp(opt, "blksize") == 0)
+        {
+            int blksize = atoi(value);
+            if (blksize >= MIN_BLKSIZE)
+                opts->blksize = blksize > MAX_BLKSIZE ? MAX_BLKSIZE : blksize;
+        }
+        else if (strcasecmp(opt, "windowsize") == 0)
+        {
+            int windowsize = atoi(value);
+            if (windowsize >= 1)
+                opts->windowsize = windowsize > MAX_WINDOWSIZE ? MAX_WINDOWSIZE : windowsize;
+        }
+        else if (strcasecmp(opt, "rollover") == 0)
+        {
+            if (strcmp(value, "0") == 0 || strcmp(value, "1") == 0)
+                opts->rollover = value[0] - '0';
+        }
+        else if (strcasecmp(opt, "multicast") == 0)
+        {
+            opts->multicast = 1;
+        }
+        else if (strcasecmp(opt, "tsize") == 0)
+        {
+            char *end_value;
+            long long tsize = strtoll(value, &end_value, 10);
+            if (*value && !*end_value && tsize >= 0)
+                opts->tsize = tsize;
+        }
+        else if (strcasecmp(opt, "timeout") == 0)
+        {
+            // Only whole seconds in range can be acknowledged as sent
+            int timeout = atoi(value);
+            if (timeout >= MIN_TIMEOUT && timeout <= MAX_TIMEOUT)
+                opts->timeout = timeout;
+        }
+
+        opt = value + strlen(value) + 1;
+    }
+}
+
+static size_t append_option(char *packet, size_t len, const char *name, long long value)
+{
+    len += sprintf(packet + len, "%s", name) + 1;
+    len += sprintf(packet + len, "%lld", value) + 1;
+    return len;
+}
+
+// Applies the accepted options to the transfer. Returns 1 if an OACK was
+// built in the packet buffer, 0 if the client asked for nothing we support
+// and -1 if the packet buffer could not be grown.
+static int negotiate_options(server_t *srv, transfer_t *t, options_t *opts)
+{
+    size_t len = 2;
+    int accepted = 0;
+
+    t->packet[0] = 0;
+    t->packet[1] = OP_OACK;
+
+    if (opts->blksize)
+    {
+        int blksize = opts->blksize;
+        if (blksize > srv->max_blksize)
+            blksize = srv->max_blksize;
+
+        int mtu;
+        socklen_t optlen = sizeof(mtu);
+        if (srv->pmtu_cap && getsockopt(t->sockfd, IPPROTO_IP, IP_MTU, &mtu, &optlen) == 0 &&
+            mtu - PKT_OVERHEAD < blksize)
+            blksize = mtu - PKT_OVERHEAD;
+
+        if (blksize < MIN_BLKSIZE)
+            blksize = MIN_BLKSIZE;
+        if (blksize > DATA_SIZE)
+        {
+            char *packet = realloc(t->packet, blksize + 4);
+            if (!packet)
+                return -1;
+            t->packet = packet;
+        }
+        t->te.blksize = blksize;
+        len = append_option(t->packet, len, "blksize", blksize);
+        accepted = 1;
+    }
+
+    if (opts->windowsize)
+    {
+        t->te.windowsize = opts->windowsize < srv->max_windowsize ? opts->windowsize : srv->max_windowsize;
+        len = append_option(t->packet, len, "windowsize", t->te.windowsize);
+        accepted = 1;
+    }
+
+    if (opts->rollover != ROLLOVER_UNSET)
+    {
+        t->te.rollover = opts->rollover;
+        len = append_option(t->packet, len, "rollover", t->te.rollover);
+        accepted = 1;
+    }
+
+    if (opts->tsize >= 0)
+    {
+        // A RRQ learns the file size; a WRQ's announced size was already
+        // checked against the free space and is echoed back
+        len = append_option(t->packet, len, "tsize", t->opcode == OP_RRQ ? (long long)t->file->size : opts->tsize);
+        accepted = 1;
+    }
+
+    if (opts->timeout)
+    {
+        tftp_engine_set_timeout(&t->te, (long long)opts->timeout * 1000000);
+        len = append_option(t->packet, len, "timeout", opts->timeout);
+        accepted = 1;
+    }
+
+    // Leave room for a whole window in the socket buffers, otherwise large
+    // windows overflow them and every window ends in a timeout
+    grow_socket_buffers(t->sockfd, t->te.windowsize * (t->te.blksize + 4 + PKT_OVERHEAD));
+
+    t->packet_len = len;
+    t->te.retries = 0;
+    return accepted;
+}
+
+// Builds the OACK for a member of a multicast session: the session's block
+// size and the member's window size, as far as it asked for them, and the
+// group with the master flag
+static size_t mcast_oack(transfer_t *t, mc_member_t *m, int master, char *packet)
+{
+    size_t len = 2;
+    packet[0] = 0;
+    packet[1] = OP_OACK;
+
+    if (m->opts.blksize)
+        len = append_option(packet, len, "blksize", t->te.blksize);
+    if (m->opts.windowsize)
+        len = append_option(packet, len, "windowsize", m->windowsize);
+    if (m->opts.rollover != ROLLOVER_UNSET)
+        len = append_option(packet, len, "rollover", m->opts.rollover);
+    if (m->opts.tsize >= 0)
+        len = append_option(packet, len, "tsize", t->file->size);
+
+    len += sprintf(packet + len, "multicast") + 1;
+    len += sprintf(packet + len, "%s,%d,%d", inet_ntoa(t->mc->group.sin_addr), ntohs(t->mc->group.sin_port), master) + 1;
+    return len;
+}
+
+// Tells the master it is in charge; its first ACK says where to start
+static void mcast_send_master_oack(transfer_t *t)
+{
+    tftp_engine_restart(&t->te);
+    t->packet_len = mcast_oack(t, t->mc->master, 1, t->packet);
+    transfer_send(t, 1);
+}
+
+// Drops the current master and hands the session to the next client in
+// line, whose first ACK tells where to resume. Returns -1 if nobody was
+// left and the session was released.
+static int mcast_next_master(server_t *srv, transfer_t *t)
+{
+    mcast_t *mc = t->mc;
+    pthread_mutex_lock(&mcast_lock);
+    free(mc->master);
+    mc->master = mc->waiting;
+    if (mc->master)
+        mc->waiting = mc->master->next;
+    else
+        mcast_unregister(mc); // nobody can join a session about to end
+    pthread_mutex_unlock(&mcast_lock);
+
+    if (!mc->master)
+    {
+        transfer_free(srv, t);
+        return -1;
+    }
+
+    t->peer = mc->master->addr;
+    if (connect(t->sockfd, (struct sockaddr *)&t->peer, sizeof(t->peer)) < 0)
+    {
+        perror("connect");
+        return mcast_next_master(srv, t);
+    }
+
+    t->te.windowsize = mc->master->windowsize;
+    grow_socket_buffers(t->sockfd, t->te.windowsize * (t->te.blksize + 4 + PKT_OVERHEAD));
+    mcast_send_master_oack(t);
+    return 0;
+}
+
+// Turns a fresh RRQ transfer into a multicast session with its client as
+// the first master. Returns -1 if out of memory.
+static int mcast_start(server_t *srv, transfer_t *t, options_t *opts)
+{
+    t->mc = calloc(1, sizeof(mcast_t));
+    mc_member_t *m = calloc(1, sizeof(mc_member_t));
+    if (!t->mc || !m)
+    {
+        free(m);
+        return -1;
+    }
+
+    m->addr = t->peer;
+    m->opts = *opts;
+    m->windowsize = t->te.windowsize;
+    t->mc->master = m;
+    t->mc->transfer = t;
+    t->te.relaxed = 1;
+
+    // Send from the interface we serve on, so that it works on loopback too
+    setsockopt(t->sockfd, IPPROTO_IP, IP_MULTICAST_IF, &srv->addr.sin_addr, sizeof(srv->addr.sin_addr));
+
+    pthread_mutex_lock(&mcast_lock);
+    t->mc->group.sin_family = AF_INET;
+    t->mc->group.sin_addr.s_addr = htonl(ntohl(srv->mcast_base.s_addr) + mcast_next++ % MCAST_GROUPS);
+    t->mc->group.sin_port = htons(MCAST_PORT);
+    t->mc->next = mcast_sessions;
+    mcast_sessions = t->mc;
+    pthread_mutex_unlock(&mcast_lock);
+
+    printf("Multicast session on %s:%d\n", inet_ntoa(t->mc->group.sin_addr), MCAST_PORT);
+    mcast_send_master_oack(t);
+    return 0;
+}
+
+// Adds a client to a running session of the same file, if the session's
+// block size is one it can accept. Returns -1 if it cannot join. Called
+// with mcast_lock held, possibly from another worker than the session's.
+static int mcast_join(server_t *srv, transfer_t *t, struct sockaddr_in *client_addr, options_t *opts)
+{
+    if (opts->blksize ? opts->blksize < t->te.blksize : t->te.blksize != DATA_SIZE)
+        return -1;
+
+    mc_member_t *m = t->mc->master;
+    mc_member_t **pp = &t->mc->waiting;
+    if (m->addr.sin_addr.s_addr != client_addr->sin_addr.s_addr || m->addr.sin_port != client_addr->sin_port)
+    {
+        // A repeated request means our OACK was lost
+        for (m = *pp; m; pp = &m->next, m = *pp)
+        {
+            if (m->addr.sin_addr.s_addr == client_addr->sin_addr.s_addr && m->addr.sin_port == client_addr->sin_port)
+                break;
+        }
+    }
+
+    if (!m)
+    {
+        m = calloc(1, sizeof(mc_member_t));
+        if (!m)
+            return -1;
+        m->addr = *client_addr;
+        m->opts = *opts;
+        m->windowsize = 1;
+        if (opts->windowsize)
+            m->windowsize = opts->windowsize < srv->max_windowsize ? opts->windowsize : srv->max_windowsize;
+        *pp = m;
+    }
+    if (m == t->mc->master)
+        return 0; // its OACK is retransmitted by the timer
+
+    char packet[BUF_SIZE];
+    size_t len = mcast_oack(t, m, 0, packet);
+    sendto(t->sockfd, packet, len, 0, (struct sockaddr *)client_addr, sizeof(*client_addr));
+    return 0;
+}
+
+// Removes a passive client that gave up
+static void mcast_leave(transfer_t *t, struct sockaddr_in *addr)
+{
+    pthread_mutex_lock(&mcast_lock);
+    for (mc_member_t **pp = &t->mc->waiting; *pp; pp = &(*pp)->next)
+    {
+        mc_member_t *m = *pp;
+        if (m->addr.sin_addr.s_addr == addr->sin_addr.s_addr && m->addr.sin_port == addr->sin_port)
+        {
+            *pp = m->next;
+            free(m);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mcast_lock);
+}
+
+void handle_rrq(server_t *srv, struct sockaddr_in *client_addr, char *filename, int netascii, options_t *opts)
+{
+    cached_file_t *file = cache_acquire(srv->cache, filename);
+    if (!file)
+    {
+        if (errno == ENOENT)
+            send_error(srv->listenfd, client_addr, sizeof(*client_addr), ERR_NOT_FOUND, "File not found");
+        else
+            send_error(srv->listenfd, client_addr, sizeof(*client_addr), ERR_ACCESS_VIOLATION, "Access violation");
+        return;
+    }
+
+    // A multicast master may ask for any block, which netascii cannot
+    // convert without starting over from the beginning of the file
+    int multicast = opts->multicast && !netascii && srv->mcast_base.s_addr != INADDR_ANY;
+    if (multicast)
+    {
+        int joined = 0;
+        pthread_mutex_lock(&mcast_lock);
+        for (mcast_t *mc = mcast_sessions; mc && !joined; mc = mc->next)
+            joined = mc->transfer->file == file && mcast_join(srv, mc->transfer, client_addr, opts) == 0;
+        pthread_mutex_unlock(&mcast_lock);
+        if (joined)
+        {
+            cache_release(srv->cache, file);
+            return;
+        }
+    }
+
+    transfer_t *t = transfer_new(srv, client_addr, OP_RRQ);
+    if (!t)
+    {
+        cache_release(srv->cache, file);
+        send_error(srv->listenfd, client_addr, sizeof(*client_addr), ERR_UNDEFINED, "Server busy");
+        return;
+    }
+    t->file = file;
+    t->netascii = netascii;
+
+    int oack = negotiate_options(srv, t, opts);
+    if (oack < 0)
+    {
+        transfer_fail(srv, t, ERR_UNDEFINED, "Out of memory");
+        return;
+    }
+    t->te.last = file->size / t->te.blksize + 1;
+    if (netascii)
+    {
+        t->marks = malloc((t->te.windowsize + 1) * sizeof(netascii_mark_t));
+        if (!t->marks)
+        {
+            transfer_fail(srv, t, ERR_UNDEFINED, "Out of memory");
+            return;
+        }
+        t->marks[1 % (t->te.windowsize + 1)] = (netascii_mark_t){0, -1};
+        t->te.last = cache_ascii_size(srv->cache, file) / t->te.blksize + 1;
+    }
+
+    if (multicast && t->te.last <= MCAST_MAX_BLOCKS)
+    {
+        // The client ACKs the OACK, which names the group, as master
+        if (mcast_start(srv, t, opts) < 0)
+            transfer_fail(srv, t, ERR_UNDEFINED, "Out of memory");
+        return;
+    }
+    if (oack)
+    {
+        // The client confirms the OACK with ACK 0
+        transfer_send(t, 1);
+        return;
+    }
 
-void send_error(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, int error_code, const char *error_msg)
-{
-    char buffer[BUF_SIZE];
-    int msg_len = snprintf(buffer, BUF_SIZE, "%c%c%c%c%s%c", 0, OP_ERROR, 0, error_code, error_msg, 0);
-    sendto(sockfd, buffer, msg_len, 0, (struct sockaddr *)client_addr, client_len);
+    tftp_engine_begin(&t->te, now_us());
+    sched_wake(srv, t);
 }
 
-void handle_rrq(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, char *filename)
+void handle_wrq(server_t *srv, struct sockaddr_in *client_addr, char *filename, int netascii, options_t *opts)
 {
-    int fd = open(filename, O_RDONLY);
-    if (fd < 0)
+    transfer_t *t = transfer_new(srv, client_addr, OP_WRQ);
+    if (!t)
     {
-        send_error(sockfd, client_addr, client_len, ERR_NOT_FOUND, "File not found");
+        send_error(srv->listenfd, client_addr, sizeof(*client_addr), ERR_UNDEFINED, "Server busy");
         return;
     }
+    t->netascii = netascii;
 
-    char buffer[BUF_SIZE];
-    char data_block[DATA_SIZE];
-    int block_num = 1;
-    ssize_t bytes_read, bytes_sent;
+    // The upload goes to a temporary file next to the target and replaces
+    // it only once complete, so the old file stays intact until then
+    t->path = strdup(filename);
+    t->temp_path = malloc(strlen(filename) + 8);
+    if (!t->path || !t->temp_path)
+    {
+        transfer_fail(srv, t, ERR_UNDEFINED, "Out of memory");
+        return;
+    }
+    sprintf(t->temp_path, "%s.XXXXXX", filename);
+    t->fd = mkstemp(t->temp_path);
+    if (t->fd < 0)
+    {
+        free(t->temp_path);
+        t->temp_path = NULL;
+        transfer_fail(srv, t, ERR_ACCESS_VIOLATION, "Access violation");
+        return;
+    }
+    fchmod(t->fd, file_mode);
 
-    do
+    // Refuse an upload announced with tsize right away if it cannot fit.
+    // Reserving the space also catches quotas, and keeps the file from
+    // fragmenting; where fallocate is not supported, compare with the free
+    // space instead.
+    if (opts->tsize > 0 && fallocate(t->fd, FALLOC_FL_KEEP_SIZE, 0, opts->tsize) < 0)
     {
-        bytes_read = read(fd, data_block, DATA_SIZE);
-        if (bytes_read < 0)
+        struct statvfs fs;
+        if (errno == ENOSPC || errno == EDQUOT || errno == EFBIG ||
+            (fstatvfs(t->fd, &fs) == 0 && (unsigned long long)fs.f_bavail * fs.f_frsize < (unsigned long long)opts->tsize))
         {
-            send_error(sockfd, client_addr, client_len, ERR_ACCESS_VIOLATION, "Access violation");
-            close(fd);
+            transfer_fail(srv, t, ERR_DISK_FULL, "Disk full or allocation exceeded");
             return;
         }
+    }
+
+    // The OACK takes the place of the initial ACK when options were accepted
+    int oack = negotiate_options(srv, t, opts);
+    if (oack < 0)
+    {
+        transfer_fail(srv, t, ERR_UNDEFINED, "Out of memory");
+        return;
+    }
+    if (oack)
+    {
+        transfer_send(t, 1);
+        return;
+    }
+
+    wrq_send_ack(t, 1);
+}
+
+// Returns -1 if the transfer was released
+static int rrq_on_packet(server_t *srv, transfer_t *t, unsigned char *buffer, ssize_t n)
+{
+    int opcode = buffer[1];
+
+    if (opcode == OP_ACK)
+    {
+        int action = tftp_engine_on_ack(&t->te, (buffer[2] << 8) | buffer[3], now_us());
+        if (action & TE_DONE)
+        { // Last packet acknowledged
+            if (t->mc)
+                return mcast_next_master(srv, t);
+            transfer_free(srv, t);
+            return -1;
+        }
+        if (action & TE_SEND_DATA)
+            sched_wake(srv, t);
+    }
+    else if (opcode == OP_ERROR)
+    {
+        fprintf(stderr, "Error from client: %s\n", (char *)buffer + 4);
+        if (t->mc)
+            return mcast_next_master(srv, t);
+        transfer_free(srv, t);
+        return -1;
+    }
+    return 0;
+}
+
+// Queues the chunk being filled for the writer thread. The last one also
+// gets the file synced, and is queued even when empty.
+static void wb_submit(server_t *srv, transfer_t *t, int last)
+{
+    wb_job_t *job = malloc(sizeof(wb_job_t));
+    if (!job)
+    {
+        t->wb_error = ENOMEM;
+        return;
+    }
+    job->t = t;
+    job->srv = srv;
+    job->fd = t->fd;
+    job->buf = t->wb_buf;
+    job->len = t->wb_len;
+    job->offset = (off_t)(t->offset - t->wb_len);
+    job->last = last;
+    job->err = 0;
+    job->next = NULL;
 
-        snprintf(buffer, BUF_SIZE, "%c%c%c%c", 0, OP_DATA, block_num >> 8, block_num & 0xFF);
-        memcpy(buffer + 4, data_block, bytes_read);
+    t->wb_buf = NULL;
+    t->wb_len = 0;
+    t->wb_pending++;
+
+    pthread_mutex_lock(&wb_lock);
+    *wb_tail = job;
+    wb_tail = &job->next;
+    pthread_cond_signal(&wb_cond);
+    pthread_mutex_unlock(&wb_lock);
+}
 
-        bytes_sent = sendto(sockfd, buffer, bytes_read + 4, 0, (struct sockaddr *)client_addr, client_len);
-        if (bytes_sent < 0)
+// Copies a block's payload into the chunk buffers, queuing each one as it
+// fills. Returns -1 if out of memory; a failure to queue is left in
+// wb_error.
+static int wb_append(server_t *srv, transfer_t *t, unsigned char *data, size_t len)
+{
+    while (len > 0)
+    {
+        if (!t->wb_buf && posix_memalign((void **)&t->wb_buf, WB_ALIGN, WB_CHUNK) != 0)
         {
-            perror("sendto");
-            close(fd);
-            return;
+            t->wb_buf = NULL;
+            return -1;
         }
 
-        block_num++;
+        size_t n = WB_CHUNK - t->wb_len;
+        if (n > len)
+            n = len;
+        memcpy(t->wb_buf + t->wb_len, data, n);
+        t->wb_len += n;
+        t->offset += n;
+        data += n;
+        len -= n;
 
-        // Wait for ACK
-        char ack_buffer[BUF_SIZE];
-        recvfrom(sockfd, ack_buffer, BUF_SIZE, 0, (struct sockaddr *)client_addr, &client_len);
+        if (t->wb_len == WB_CHUNK)
+        {
+            wb_submit(srv, t, 0);
+            if (t->wb_error)
+                return 0;
+        }
+    }
+    return 0;
+}
+
+// Same as wb_append, converting from netascii on the way into the chunk
+// buffers. A piece never takes the last byte of a chunk: a CR held back
+// from the previous block may come out in front of it.
+static int wb_append_netascii(server_t *srv, transfer_t *t, unsigned char *data, size_t len)
+{
+    while (len > 0)
+    {
+        if (!t->wb_buf && posix_memalign((void **)&t->wb_buf, WB_ALIGN, WB_CHUNK) != 0)
+        {
+            t->wb_buf = NULL;
+            return -1;
+        }
 
-    } while (bytes_read == DATA_SIZE);
+        size_t n = WB_CHUNK - t->wb_len - 1;
+        if (n > len)
+            n = len;
+        size_t out = netascii_decode(&t->nad, data, n, t->wb_buf + t->wb_len);
+        t->wb_len += out;
+        t->offset += out;
+        data += n;
+        len -= n;
 
-    close(fd);
+        if (t->wb_len >= WB_CHUNK - 1)
+        {
+            wb_submit(srv, t, 0);
+            if (t->wb_error)
+                return 0;
+        }
+    }
+    return 0;
 }
 
-void handle_wrq(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, char *filename)
+// Writer thread: flushes queued chunks in order and hands each back to
+// its worker through the worker's eventfd
+static void *wb_writer(void *arg)
 {
-    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (fd < 0)
+    (void)arg;
+    while (1)
     {
-        send_error(sockfd, client_addr, client_len, ERR_ACCESS_VIOLATION, "Access violation");
-        return;
+        pthread_mutex_lock(&wb_lock);
+        while (!wb_queue)
+            pthread_cond_wait(&wb_cond, &wb_lock);
+        wb_job_t *job = wb_queue;
+        wb_queue = job->next;
+        if (!wb_queue)
+            wb_tail = &wb_queue;
+        pthread_mutex_unlock(&wb_lock);
+
+        for (size_t done = 0; done < job->len;)
+        {
+            ssize_t n = pwrite(job->fd, job->buf + done, job->len - done, job->offset + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+            {
+                job->err = errno;
+                break;
+            }
+            done += n;
+        }
+        if (job->last && !job->err && fdatasync(job->fd) < 0)
+            job->err = errno;
+
+        server_t *srv = job->srv;
+        pthread_mutex_lock(&srv->wb_lock);
+        job->next = srv->wb_done;
+        srv->wb_done = job;
+        pthread_mutex_unlock(&srv->wb_lock);
+
+        uint64_t one = 1;
+        if (write(srv->wb_efd, &one, sizeof(one)) < 0)
+            perror("eventfd");
     }
+    return NULL;
+}
 
-    char buffer[BUF_SIZE];
-    char ack_buffer[4] = {0, OP_ACK, 0, 0};
-    int block_num = 0;
-    ssize_t bytes_received, bytes_written;
+// The whole upload is on disk: put it in place of the target and send
+// the final ACK. Returns -1 if the transfer was released.
+static int wrq_commit(server_t *srv, transfer_t *t)
+{
+    close(t->fd);
+    t->fd = -1;
+    if (rename(t->temp_path, t->path) < 0)
+    {
+        perror("rename");
+        transfer_fail(srv, t, ERR_ACCESS_VIOLATION, "Access violation");
+        return -1;
+    }
+    free(t->temp_path);
+    t->temp_path = NULL;
+
+    // Keep the TID around in case our ACK gets lost
+    t->commit = 0;
+    wrq_send_ack(t, 0);
+    return 0;
+}
+
+// Fails the transfer after a write error. Returns -1.
+static int wrq_disk_error(server_t *srv, transfer_t *t)
+{
+    fprintf(stderr, "write %s: %s\n", t->temp_path, strerror(t->wb_error));
+    if (t->wb_error == ENOSPC || t->wb_error == EDQUOT)
+        transfer_fail(srv, t, ERR_DISK_FULL, "Disk full or allocation exceeded");
+    else
+        transfer_fail(srv, t, ERR_ACCESS_VIOLATION, "Access violation");
+    return -1;
+}
 
-    // Send initial ACK for WRQ
-    sendto(sockfd, ack_buffer, 4, 0, (struct sockaddr *)client_addr, client_len);
+// Takes back the chunks the writer has flushed for this worker's transfers
+static void wb_on_done(server_t *srv)
+{
+    uint64_t count;
+    if (read(srv->wb_efd, &count, sizeof(count)) < 0)
+        return;
 
-    while (1)
+    pthread_mutex_lock(&srv->wb_lock);
+    wb_job_t *job = srv->wb_done;
+    srv->wb_done = NULL;
+    pthread_mutex_unlock(&srv->wb_lock);
+
+    while (job)
     {
-        bytes_received = recvfrom(sockfd, buffer, BUF_SIZE, 0, (struct sockaddr *)client_addr, &client_len);
-        if (bytes_received < 0)
+        wb_job_t *next = job->next;
+        transfer_t *t = job->t;
+        t->wb_pending--;
+        if (job->err && !t->wb_error)
+            t->wb_error = job->err;
+        free(job->buf);
+        free(job);
+        job = next;
+
+        if (t->sockfd < 0)
         {
-            perror("recvfrom");
-            close(fd);
-            return;
+            // Released while the writer still had some of its chunks
+            if (t->wb_pending == 0)
+                transfer_free(srv, t);
+        }
+        else if (t->wb_error)
+        {
+            wrq_disk_error(srv, t);
+        }
+        else if (t->commit)
+        {
+            if (t->wb_pending == 0)
+                wrq_commit(srv, t);
         }
+        else if (t->ack_deferred && t->wb_pending < WB_MAX_PENDING)
+        {
+            t->ack_deferred = 0;
+            wrq_send_ack(t, 0);
+        }
+    }
+}
 
-        int opcode = buffer[1];
-        // int recv_block_num = (unsigned int)(buffer[2] << 8) | (unsigned int)buffer[3];
-        int recv_block_num = ((buffer[2] << 8) | (buffer[3] & 0x0FF));
-        if (opcode == OP_DATA && recv_block_num == block_num + 1)
+// Returns -1 if the transfer was released
+static int wrq_on_packet(server_t *srv, transfer_t *t, unsigned char *buffer, ssize_t n)
+{
+    int opcode = buffer[1];
+
+    if (opcode == OP_DATA)
+    {
+        int action = tftp_engine_on_data(&t->te, (buffer[2] << 8) | buffer[3], n - 4, now_us());
+        if (action & TE_DELIVER)
         {
-            bytes_written = write(fd, buffer + 4, bytes_received - 4);
-            if (bytes_written < 0)
+            int rc = t->netascii ? wb_append_netascii(srv, t, buffer + 4, n - 4) : wb_append(srv, t, buffer + 4, n - 4);
+            unsigned char cr;
+            if (rc == 0 && (action & TE_LAST) && t->netascii && netascii_decode_end(&t->nad, &cr))
+                rc = wb_append(srv, t, &cr, 1);
+            if (rc < 0)
             {
-                perror("write");
-                close(fd);
-                return;
+                transfer_fail(srv, t, ERR_UNDEFINED, "Out of memory");
+                return -1;
             }
+            if (t->wb_error)
+                return wrq_disk_error(srv, t);
+        }
+
+        if (action & TE_LAST)
+        {
+            // Last packet: the final ACK goes out once it is all on disk
+            wb_submit(srv, t, 1);
+            if (t->wb_error)
+                return wrq_disk_error(srv, t);
+            t->commit = 1;
+            t->te.deadline = now_us() + DALLY_US;
+        }
+        else if (t->commit || !(action & TE_SEND_ACK))
+        {
+            // Retransmissions while we wait for the writer are answered
+            // when it catches up
+        }
+        else if (t->ack_deferred || ((action & TE_DELIVER) && t->wb_pending >= WB_MAX_PENDING))
+        {
+            // Hold the ACK, and with it the client, while the writer is
+            // behind
+            t->ack_deferred = 1;
+            t->te.deadline = now_us() + DALLY_US;
+        }
+        else
+        {
+            wrq_send_ack(t, 1);
+        }
+    }
+    else if (opcode == OP_ERROR)
+    {
+        fprintf(stderr, "Error from client: %s\n", (char *)buffer + 4);
+        transfer_free(srv, t);
+        return -1;
+    }
+    return 0;
+}
+
+// Points the recvmmsg vector at consecutive slots of rx_buffer and returns
+// how many fit
+static int rx_prepare(size_t slot)
+{
+    int vlen = RX_BATCH_BYTES / slot;
+    if (vlen > RX_BATCH)
+        vlen = RX_BATCH;
 
-            block_num++;
-            ack_buffer[2] = buffer[2];
-            ack_buffer[3] = buffer[3];
-            sendto(sockfd, ack_buffer, 4, 0, (struct sockaddr *)client_addr, client_len);
+    for (int i = 0; i < vlen; i++)
+    {
+        rx_iov[i].iov_base = rx_buffer + i * slot;
+        rx_iov[i].iov_len = slot;
+        memset(&rx_msgs[i].msg_hdr, 0, sizeof(rx_msgs[i].msg_hdr));
+        rx_msgs[i].msg_hdr.msg_iov = &rx_iov[i];
+        rx_msgs[i].msg_hdr.msg_iovlen = 1;
+        rx_msgs[i].msg_hdr.msg_name = &rx_addrs[i];
+        rx_msgs[i].msg_hdr.msg_namelen = sizeof(rx_addrs[i]);
+    }
+    return vlen;
+}
 
-            if (bytes_received < BUF_SIZE)
-            { // Last packet
-                break;
+// Returns -1 if the transfer was released
+static int transfer_on_readable(server_t *srv, transfer_t *t)
+{
+    while (1)
+    {
+        // No valid packet from the client is longer than a DATA block
+        int vlen = rx_prepare(t->te.blksize + 4);
+        int got = recvmmsg(t->sockfd, rx_msgs, vlen, 0, NULL);
+        if (got < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                // e.g. ECONNREFUSED: the client went away
+                perror("recvmmsg");
+                transfer_free(srv, t);
+                return -1;
             }
+            return 0;
         }
-        else if (opcode == OP_ERROR)
+
+        for (int i = 0; i < got; i++)
         {
-            fprintf(stderr, "Error from client: %s\n", buffer + 4);
-            close(fd);
+            unsigned char *buffer = rx_iov[i].iov_base;
+            ssize_t n = rx_msgs[i].msg_len;
+            if (n < 4 || (rx_msgs[i].msg_hdr.msg_flags & MSG_TRUNC))
+                continue;
+
+            // A multicast socket changes masters; anything still queued
+            // from an earlier one, or a passive client quitting, comes here
+            struct sockaddr_in *from = &rx_addrs[i];
+            if (t->mc && (from->sin_addr.s_addr != t->peer.sin_addr.s_addr || from->sin_port != t->peer.sin_port))
+            {
+                if (buffer[1] == OP_ERROR)
+                    mcast_leave(t, from);
+                continue;
+            }
+
+            int rc = t->opcode == OP_RRQ ? rrq_on_packet(srv, t, buffer, n) : wrq_on_packet(srv, t, buffer, n);
+            if (rc < 0)
+                return -1;
+        }
+
+        if (got < vlen)
+            return 0; // drained
+    }
+}
+
+static void transfer_on_timeout(server_t *srv, transfer_t *t)
+{
+    if (t->commit || t->ack_deferred)
+    {
+        // Waiting on the disk, not on the client
+        t->te.deadline = now_us() + DALLY_US;
+        return;
+    }
+
+    int action = tftp_engine_on_timeout(&t->te, now_us());
+    if (action & TE_DONE)
+    {
+        transfer_free(srv, t);
+    }
+    else if (action & TE_FAIL)
+    {
+        fprintf(stderr, "Transfer to %s:%d timed out\n", inet_ntoa(t->peer.sin_addr), ntohs(t->peer.sin_port));
+        if (t->mc)
+        {
+            send_error(t->sockfd, &t->peer, sizeof(t->peer), ERR_UNDEFINED, "Timeout");
+            mcast_next_master(srv, t);
             return;
         }
-        else
+        transfer_fail(srv, t, ERR_UNDEFINED, "Timeout");
+    }
+    else if (action & TE_RESEND)
+    {
+        transfer_send(t, 0);
+    }
+    else if (action & TE_SEND_ACK)
+    {
+        wrq_send_ack(t, 0);
+    }
+    else if (action & TE_SEND_DATA)
+    {
+        sched_wake(srv, t);
+    }
+}
+
+static void handle_request(server_t *srv, struct sockaddr_in *client_addr, char *buffer, ssize_t n)
+{
+    buffer[n] = '\0';
+
+    int opcode = (unsigned char)buffer[1];
+    char *filename = buffer + 2;
+    char *mode = filename + strlen(filename) + 1;
+
+    if (n < 4 || buffer[0] != 0 || mode >= buffer + n)
+    {
+        send_error(srv->listenfd, client_addr, sizeof(*client_addr), ERR_ILLEGAL_OPERATION, "Illegal TFTP operation");
+        return;
+    }
+
+    // "mail" went away with RFC 1350
+    int netascii = strcasecmp(mode, "netascii") == 0;
+    if (!netascii && strcasecmp(mode, "octet") != 0)
+    {
+        send_error(srv->listenfd, client_addr, sizeof(*client_addr), ERR_ILLEGAL_OPERATION, "Unsupported mode");
+        return;
+    }
+
+    options_t opts;
+    parse_options(mode + strlen(mode) + 1, buffer + n, &opts);
+
+    if (opcode == OP_RRQ)
+    {
+        printf("RRQ from %s: %s (%s)\n", inet_ntoa(client_addr->sin_addr), filename, mode);
+        handle_rrq(srv, client_addr, filename, netascii, &opts);
+    }
+    else if (opcode == OP_WRQ)
+    {
+        printf("WRQ from %s: %s (%s)\n", inet_ntoa(client_addr->sin_addr), filename, mode);
+        handle_wrq(srv, client_addr, filename, netascii, &opts);
+    }
+    else
+    {
+        send_error(srv->listenfd, client_addr, sizeof(*client_addr), ERR_ILLEGAL_OPERATION, "Illegal TFTP operation");
+    }
+}
+
+static void listener_on_readable(server_t *srv)
+{
+    while (1)
+    {
+        int vlen = rx_prepare(BUF_SIZE + 1); // + 1 for handle_request's terminator
+        for (int i = 0; i < vlen; i++)
+            rx_iov[i].iov_len = BUF_SIZE;
+
+        int got = recvmmsg(srv->listenfd, rx_msgs, vlen, 0, NULL);
+        if (got < 0)
         {
-            printf("rec block num: %d\n", recv_block_num);
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("recvmmsg");
+            return;
         }
+
+        for (int i = 0; i < got; i++)
+            handle_request(srv, &rx_addrs[i], rx_iov[i].iov_base, rx_msgs[i].msg_len);
+
+        if (got < vlen)
+            return;
     }
+}
 
-    close(fd);
+// Runs the retransmission timers and returns the epoll timeout (in ms,
+// rounded up) until the next one
+static int run_timers(server_t *srv)
+{
+    long long now = now_us();
+    long long next = -1;
+
+    transfer_t *t = srv->transfers;
+    while (t)
+    {
+        transfer_t *following = t->next;
+        if (t->te.deadline <= now)
+            transfer_on_timeout(srv, t);
+        t = following;
+    }
+
+    for (t = srv->transfers; t; t = t->next)
+    {
+        if (next < 0 || t->te.deadline < next)
+            next = t->te.deadline;
+    }
+
+    if (next < 0)
+        return -1;
+    return next > now ? (int)((next - now + 999) / 1000) : 0;
 }
 
-int main(int argc, char *argv[])
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-b max_blksize] [-w max_windowsize] [-r 0|1] [-c cache_mb] [-M group] [-t workers] [-B kB/s] [-P kB/s] [-m] <server_ip>\n", prog);
+    fprintf(stderr, "  -b  largest block size granted to clients (default %d)\n", MAX_BLKSIZE);
+    fprintf(stderr, "  -w  largest window size granted to clients (default %d)\n", DEFAULT_MAX_WINDOWSIZE);
+    fprintf(stderr, "  -r  block number after 65535 unless the client negotiates rollover (default 0)\n");
+    fprintf(stderr, "  -c  megabytes of idle files kept mapped for RRQ (default %d)\n", DEFAULT_CACHE_MB);
+    fprintf(stderr, "  -M  serve RFC 2090 multicast requests on groups from this address up\n");
+    fprintf(stderr, "  -t  worker threads, one per core by default\n");
+    fprintf(stderr, "  -B  total DATA rate cap, split evenly between workers (default none)\n");
+    fprintf(stderr, "  -P  DATA rate cap for each transfer (default none)\n");
+    fprintf(stderr, "  -m  never grant a block size above the path MTU\n");
+    exit(EXIT_FAILURE);
+}
+
+// Opens the worker's own listening socket. With SO_REUSEPORT every worker
+// binds the same port and the kernel spreads requests between them by a
+// hash of the client's address, so retransmitted requests land on the
+// same worker as the first one.
+static void worker_open(server_t *srv)
 {
-    if (argc != 2)
+    int one = 1;
+
+    srv->listenfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (srv->listenfd < 0)
     {
-        fprintf(stderr, "Usage: %s <server_ip>\n", argv[0]);
+        perror("socket");
         exit(EXIT_FAILURE);
     }
 
-    const char *server_ip = argv[1];
+    if (setsockopt(srv->listenfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0 ||
+        bind(srv->listenfd, (struct sockaddr *)&srv->addr, sizeof(srv->addr)) < 0)
+    {
+        perror("bind");
+        close(srv->listenfd);
+        exit(EXIT_FAILURE);
+    }
+    set_nonblocking(srv->listenfd);
 
-    int sockfd;
-    struct sockaddr_in server_addr, client_addr;
-    char buffer[BUF_SIZE];
-    socklen_t client_len = sizeof(client_addr);
+    // Probe for UDP GSO (Linux 4.18+); without it DATA goes one block per datagram
+    int gso_size = 0;
+    srv->gso = setsockopt(srv->listenfd, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)) == 0;
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0)
+    srv->epfd = epoll_create1(0);
+    if (srv->epfd < 0)
     {
-        perror("socket");
+        perror("epoll_create1");
         exit(EXIT_FAILURE);
     }
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = inet_addr(server_ip);
-    server_addr.sin_port = htons(SERVER_PORT);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL marks the listening socket
+    epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->listenfd, &ev);
 
-    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    srv->wb_efd = eventfd(0, EFD_NONBLOCK);
+    if (srv->wb_efd < 0)
     {
-        perror("bind");
-        close(sockfd);
+        perror("eventfd");
         exit(EXIT_FAILURE);
     }
+    pthread_mutex_init(&srv->wb_lock, NULL);
+    ev.data.ptr = srv; // and srv the writer's completions
+    epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->wb_efd, &ev);
+}
+
+// Event loop of one worker: its listening socket and the transfers it
+// started, which never move to another worker
+static void *worker_run(void *arg)
+{
+    server_t *srv = arg;
 
-    printf("Listening on %s:%d ...\n", inet_ntoa(server_addr.sin_addr), ntohs(server_addr.sin_port));
+    if (srv->cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(srv->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
 
+    struct epoll_event events[MAX_EVENTS];
+    int timeout = -1;
     while (1)
     {
-        ssize_t n = recvfrom(sockfd, buffer, BUF_SIZE, 0, (struct sockaddr *)&client_addr, &client_len);
-        if (n < 0)
+        int nfds = epoll_wait(srv->epfd, events, MAX_EVENTS, timeout);
+        if (nfds < 0)
         {
-            perror("recvfrom");
-            continue;
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < nfds; i++)
+        {
+            if (events[i].data.ptr == NULL)
+            {
+                listener_on_readable(srv);
+                continue;
+            }
+            if (events[i].data.ptr == srv)
+            {
+                wb_on_done(srv);
+                continue;
+            }
+
+            transfer_t *t = events[i].data.ptr;
+            if (events[i].events & (EPOLLIN | EPOLLERR))
+            {
+                if (transfer_on_readable(srv, t) < 0)
+                    continue;
+            }
+            if (events[i].events & EPOLLOUT)
+            {
+                transfer_set_writable(srv, t, 0);
+                sched_wake(srv, t);
+            }
         }
 
-        buffer[n] = '\0';
+        timeout = run_timers(srv);
+        long long wait = sched_run(srv);
+        if (wait >= 0 && (timeout < 0 || (wait + 999) / 1000 < timeout))
+            timeout = (int)((wait + 999) / 1000);
+    }
+
+    close(srv->epfd);
+    close(srv->listenfd);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    static file_cache_t cache;
+    cache.budget = (size_t)DEFAULT_CACHE_MB << 20;
+    pthread_mutex_init(&cache.lock, NULL);
 
-        int opcode = buffer[1];
-        char *filename = buffer + 2;
-        char *mode = filename + strlen(filename) + 1;
+    server_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.max_blksize = MAX_BLKSIZE;
+    cfg.max_windowsize = DEFAULT_MAX_WINDOWSIZE;
+    cfg.cache = &cache;
 
-        if (opcode == OP_RRQ)
+    // Cores we may run on, in case we were started under taskset or a cpuset
+    cpu_set_t allowed;
+    int cpus = 1;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        cpus = CPU_COUNT(&allowed);
+    else
+        CPU_ZERO(&allowed);
+    int workers = cpus;
+    long long rate = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:w:r:c:M:t:B:P:m")) != -1)
+    {
+        switch (opt)
         {
-            printf("RRQ from %s: %s (%s)\n", inet_ntoa(client_addr.sin_addr), filename, mode);
-            handle_rrq(sockfd, &client_addr, client_len, filename);
+        case 'b':
+            cfg.max_blksize = atoi(optarg);
+            if (cfg.max_blksize < MIN_BLKSIZE || cfg.max_blksize > MAX_BLKSIZE)
+                usage(argv[0]);
+            break;
+        case 'w':
+            cfg.max_windowsize = atoi(optarg);
+            if (cfg.max_windowsize < 1 || cfg.max_windowsize > MAX_WINDOWSIZE)
+                usage(argv[0]);
+            break;
+        case 'r':
+            if (strcmp(optarg, "0") != 0 && strcmp(optarg, "1") != 0)
+                usage(argv[0]);
+            cfg.rollover = optarg[0] - '0';
+            break;
+        case 'c':
+            if (atoi(optarg) < 0)
+                usage(argv[0]);
+            cache.budget = (size_t)atoi(optarg) << 20;
+            break;
+        case 'M':
+            if (inet_pton(AF_INET, optarg, &cfg.mcast_base) <= 0 || !IN_MULTICAST(ntohl(cfg.mcast_base.s_addr)))
+                usage(argv[0]);
+            break;
+        case 't':
+            workers = atoi(optarg);
+            if (workers < 1)
+                usage(argv[0]);
+            break;
+        case 'B':
+            rate = atoll(optarg) * 1000;
+            if (rate <= 0)
+                usage(argv[0]);
+            break;
+        case 'P':
+            cfg.client_rate = atoll(optarg) * 1000;
+            if (cfg.client_rate <= 0)
+                usage(argv[0]);
+            break;
+        case 'm':
+            cfg.pmtu_cap = 1;
+            break;
+        default:
+            usage(argv[0]);
         }
-        else if (opcode == OP_WRQ)
+    }
+    cfg.rate = rate / workers;
+    if (rate && !cfg.rate)
+        cfg.rate = 1;
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    const char *server_ip = argv[optind];
+    cfg.addr.sin_family = AF_INET;
+    cfg.addr.sin_addr.s_addr = inet_addr(server_ip);
+    cfg.addr.sin_port = htons(SERVER_PORT);
+
+    server_t *srv = calloc(workers, sizeof(server_t));
+    if (!srv)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    int cpu = -1;
+    for (int i = 0; i < workers; i++)
+    {
+        srv[i] = cfg;
+        // Only pin when there is a core for each worker
+        srv[i].cpu = -1;
+        if (workers <= cpus)
         {
-            printf("WRQ from %s: %s (%s)\n", inet_ntoa(client_addr.sin_addr), filename, mode);
-            handle_wrq(sockfd, &client_addr, client_len, filename);
+            while (++cpu < CPU_SETSIZE && !CPU_ISSET(cpu, &allowed))
+                ;
+            if (cpu < CPU_SETSIZE)
+                srv[i].cpu = cpu;
         }
-        else
+        worker_open(&srv[i]);
+    }
+
+    mode_t mask = umask(0);
+    umask(mask);
+    file_mode = 0666 & ~mask;
+
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, wb_writer, NULL) != 0)
+    {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Listening on %s:%d with %d worker%s ...\n", inet_ntoa(cfg.addr.sin_addr), ntohs(cfg.addr.sin_port),
+           workers, workers == 1 ? "" : "s");
+
+    for (int i = 0; i < workers; i++)
+    {
+        if (pthread_create(&srv[i].thread, NULL, worker_run, &srv[i]) != 0)
         {
-            send_error(sockfd, &client_addr, client_len, ERR_ILLEGAL_OPERATION, "Illegal TFTP operation");
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
         }
     }
+    for (int i = 0; i < workers; i++)
+        pthread_join(srv[i].thread, NULL);
 
-    close(sockfd);
+    free(srv);
     return 0;
 }
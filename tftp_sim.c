@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <time.h>
+#include "tftp_engine.h"
+#include "netsim.h"
+
+// Deterministic TFTP simulator: a sender and a receiver engine, as used by
+// tftp_server and tftp_client, exchange DATA and ACKs over a simulated
+// link that drops, duplicates, reorders and delays packets. Time is
+// virtual, so a run takes as long as the engines need to process it, and
+// a given seed always replays the same transfers.
+
+#define MAX_BLKSIZE 65464
+#define MAX_WINDOWSIZE 65535
+#define PKT_OVERHEAD 32 // IPv4 + UDP + TFTP headers
+
+#define TO_SENDER 0
+#define TO_RECEIVER 1
+
+// A packet on the link. The payload of a DATA block is never needed, only
+// its length.
+typedef struct
+{
+    int to;
+    unsigned char header[4];
+    int len;
+} packet_t;
+
+typedef struct
+{
+    long long elapsed; // until the last block was delivered, -1 if never
+    int failed;
+    long long packets;     // sent, both ways
+    long long data_sent;   // DATA packets, retransmissions included
+    long long timeouts;    // retransmission timer expiries, both sides
+} result_t;
+
+static netsim_link_t net;
+static uint64_t rng_state; // both directions draw from it
+static netsim_dir_t dirs[2];
+static netsim_heap_t heap;
+
+// Puts a packet on the link at time now, through the impairments
+static void link_send(int to, unsigned char *header, int len, long long now, result_t *res)
+{
+    res->packets++;
+
+    long long at[2];
+    int copies = netsim_send(&net, &dirs[to], len + PKT_OVERHEAD, now, at, NULL);
+    for (int i = 0; i < copies; i++)
+    {
+        packet_t *p = netsim_heap_push(&heap, at[i]);
+        p->to = to;
+        memcpy(p->header, header, 4);
+        p->len = len;
+    }
+}
+
+// Size of block on the wire, header included
+static int block_len(tftp_engine_t *e, uint64_t block, uint64_t size)
+{
+    if (block < e->last)
+        return e->blksize + 4;
+    return (int)(size - (block - 1) * e->blksize) + 4;
+}
+
+static void send_window(tftp_engine_t *tx, uint64_t size, long long now, result_t *res)
+{
+    uint64_t end = tftp_engine_window_end(tx);
+    for (uint64_t block = tx->next; block <= end; block++)
+    {
+        unsigned char header[4];
+        tftp_engine_data_header(tx, block, header);
+        link_send(TO_RECEIVER, header, block_len(tx, block, size), now, res);
+        res->data_sent++;
+    }
+    tftp_engine_sent(tx, (int)(end - tx->next + 1), now);
+}
+
+static void send_ack(tftp_engine_t *rx, int fresh, long long now, result_t *res)
+{
+    unsigned char packet[4];
+    tftp_engine_ack(rx, packet, fresh, now);
+    link_send(TO_SENDER, packet, 4, now, res);
+}
+
+// One transfer of size bytes, as a RRQ without an OACK: the receiver has
+// just sent its request and the sender starts with the first window
+static result_t run_transfer(uint64_t size, int blksize, int windowsize)
+{
+    result_t res = {-1, 0, 0, 0, 0};
+    tftp_engine_t tx, rx;
+    long long now = 0;
+
+    netsim_heap_clear(&heap);
+    for (int i = 0; i < 2; i++)
+        dirs[i] = (netsim_dir_t){.rng = &rng_state};
+
+    tftp_engine_init(&tx, TE_SENDER, 0);
+    tftp_engine_init(&rx, TE_RECEIVER, 0);
+    tx.blksize = rx.blksize = blksize;
+    tx.windowsize = rx.windowsize = windowsize;
+    tx.last = size / blksize + 1;
+
+    tftp_engine_arm(&rx, 1, now);
+    tftp_engine_begin(&tx, now);
+    send_window(&tx, size, now, &res);
+
+    uint64_t delivered = 0;
+    int tx_active = 1;
+    int rx_active = 1;
+    while (tx_active || rx_active)
+    {
+        // Next event: a packet arriving or a timer expiring
+        long long next = netsim_heap_next(&heap);
+        if (tx_active && (next < 0 || tx.deadline < next))
+            next = tx.deadline;
+        if (rx_active && (next < 0 || rx.deadline < next))
+            next = rx.deadline;
+        if (next < 0)
+            break;
+        if (next > now)
+            now = next;
+
+        if (tx_active && tx.deadline <= now)
+        {
+            res.timeouts++;
+            int action = tftp_engine_on_timeout(&tx, now);
+            if (action & TE_FAIL)
+            {
+                tx_active = 0;
+                res.failed = res.elapsed < 0;
+            }
+            else if (action & TE_SEND_DATA)
+            {
+                send_window(&tx, size, now, &res);
+            }
+            continue;
+        }
+        if (rx_active && rx.deadline <= now)
+        {
+            int action = tftp_engine_on_timeout(&rx, now);
+            if (action & TE_DONE)
+            {
+                rx_active = 0;
+                continue;
+            }
+            res.timeouts++;
+            if (action & TE_FAIL)
+            {
+                rx_active = 0;
+                res.failed = 1;
+            }
+            else if (action & TE_RESEND)
+            {
+                // The request again, which the sender, already running, ignores
+                tftp_engine_arm(&rx, 0, now);
+            }
+            else if (action & TE_SEND_ACK)
+            {
+                send_ack(&rx, 0, now, &res);
+            }
+            continue;
+        }
+
+        packet_t p = *(packet_t *)netsim_heap_pop(&heap);
+        uint16_t wire = (p.header[2] << 8) | p.header[3];
+        if (p.to == TO_SENDER && tx_active)
+        {
+            int action = tftp_engine_on_ack(&tx, wire, now);
+            if (action & TE_DONE)
+                tx_active = 0;
+            else if (action & TE_SEND_DATA)
+                send_window(&tx, size, now, &res);
+        }
+        else if (p.to == TO_RECEIVER && rx_active)
+        {
+            int action = tftp_engine_on_data(&rx, wire, p.len - 4, now);
+            if (action & TE_DELIVER)
+            {
+                if (p.len != block_len(&tx, rx.block, size))
+                {
+                    fprintf(stderr, "Block %" PRIu64 " delivered with the wrong length\n", rx.block);
+                    exit(EXIT_FAILURE);
+                }
+                delivered += p.len - 4;
+            }
+            if (action & TE_SEND_ACK)
+                send_ack(&rx, 1, now, &res);
+            if (action & TE_LAST)
+            {
+                if (delivered != size)
+                {
+                    fprintf(stderr, "Delivered %" PRIu64 " of %" PRIu64 " bytes\n", delivered, size);
+                    exit(EXIT_FAILURE);
+                }
+                res.elapsed = now;
+            }
+        }
+    }
+    return res;
+}
+
+static int compare_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static long long percentile(long long *sorted, int n, int p)
+{
+    int i = (int)((long long)p * n / 100);
+    return sorted[i < n ? i : n - 1];
+}
+
+static long long wall_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n runs] [-s bytes] [-b blksize] [-w windowsize] [-l loss%%] [-d dup%%] [-o reorder%%] [-D delay_us] [-j jitter_us] [-R kB/s] [-S seed]\n", prog);
+    fprintf(stderr, "  -n  transfers to simulate (default 100)\n");
+    fprintf(stderr, "  -s  size of each file (default 1048576)\n");
+    fprintf(stderr, "  -b  block size (default %d)\n", DATA_SIZE);
+    fprintf(stderr, "  -w  window size (default 1)\n");
+    fprintf(stderr, "  -l  packets lost, each way (default 0)\n");
+    fprintf(stderr, "  -d  packets duplicated (default 0)\n");
+    fprintf(stderr, "  -o  packets reordered, held back behind later ones (default 0)\n");
+    fprintf(stderr, "  -D  one-way delay in microseconds (default 1000)\n");
+    fprintf(stderr, "  -j  random extra delay, up to this many microseconds (default 0)\n");
+    fprintf(stderr, "  -R  link rate each way (default unlimited)\n");
+    fprintf(stderr, "  -S  random seed; the same seed replays the same runs (default 1)\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int runs = 100;
+    long long size = 1048576;
+    int blksize = DATA_SIZE;
+    int windowsize = 1;
+    unsigned long long seed = 1;
+
+    net.delay = 1000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:b:w:l:d:o:D:j:R:S:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            runs = atoi(optarg);
+            if (runs < 1)
+                usage(argv[0]);
+            break;
+        case 's':
+            size = atoll(optarg);
+            if (size < 0)
+                usage(argv[0]);
+            break;
+        case 'b':
+            blksize = atoi(optarg);
+            if (blksize < 8 || blksize > MAX_BLKSIZE)
+                usage(argv[0]);
+            break;
+        case 'w':
+            windowsize = atoi(optarg);
+            if (windowsize < 1 || windowsize > MAX_WINDOWSIZE)
+                usage(argv[0]);
+            break;
+        case 'l':
+            net.loss = atof(optarg) / 100;
+            break;
+        case 'd':
+            net.dup = atof(optarg) / 100;
+            break;
+        case 'o':
+            net.reorder = atof(optarg) / 100;
+            break;
+        case 'D':
+            net.delay = atoll(optarg);
+            if (net.delay < 0)
+                usage(argv[0]);
+            break;
+        case 'j':
+            net.jitter = atoll(optarg);
+            if (net.jitter < 0)
+                usage(argv[0]);
+            break;
+        case 'R':
+            net.rate = atoll(optarg) * 1000;
+            if (net.rate < 0)
+                usage(argv[0]);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc)
+        usage(argv[0]);
+
+    rng_state = seed ? seed : 1;
+    netsim_heap_init(&heap, sizeof(packet_t));
+
+    long long *elapsed = malloc(runs * sizeof(long long));
+    if (!elapsed)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    int done = 0;
+    int failed = 0;
+    long long packets = 0, data_sent = 0, timeouts = 0;
+    long long start = wall_us();
+    for (int i = 0; i < runs; i++)
+    {
+        result_t res = run_transfer(size, blksize, windowsize);
+        packets += res.packets;
+        data_sent += res.data_sent;
+        timeouts += res.timeouts;
+        if (res.failed)
+            failed++;
+        else
+            elapsed[done++] = res.elapsed;
+    }
+    long long wall = wall_us() - start;
+    if (wall < 1)
+        wall = 1;
+
+    long long blocks = (long long)runs * (size / blksize + 1);
+    printf("%d transfers of %lld bytes, blksize %d, windowsize %d\n", runs, size, blksize, windowsize);
+    printf("link: loss %.2f%%, dup %.2f%%, reorder %.2f%%, delay %lld us, jitter %lld us, rate %lld kB/s\n",
+           net.loss * 100, net.dup * 100, net.reorder * 100, net.delay, net.jitter, net.rate / 1000);
+    printf("engine: %lld packets in %.3f s, %.0f packets/s\n", packets, wall / 1e6, packets * 1e6 / wall);
+    printf("DATA sent: %lld for %lld blocks (%.2f%% retransmitted), %lld timeouts\n",
+           data_sent, blocks, blocks ? (data_sent - blocks) * 100.0 / blocks : 0.0, timeouts);
+    printf("completed: %d, failed: %d\n", done, failed);
+
+    if (done > 0)
+    {
+        qsort(elapsed, done, sizeof(long long), compare_ll);
+        long long total = 0;
+        for (int i = 0; i < done; i++)
+            total += elapsed[i];
+        printf("transfer time (ms): min %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f mean %.3f\n",
+               elapsed[0] / 1e3, percentile(elapsed, done, 50) / 1e3, percentile(elapsed, done, 90) / 1e3,
+               percentile(elapsed, done, 99) / 1e3, elapsed[done - 1] / 1e3, total / 1e3 / done);
+        printf("goodput (p50): %.1f kB/s\n", percentile(elapsed, done, 50) ? size * 1e3 / percentile(elapsed, done, 50) : 0.0);
+    }
+
+    free(elapsed);
+    netsim_heap_free(&heap);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,544 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "netsim.h"
+
+// UDP impairment proxy: relays datagrams between clients and a server
+// through a link that drops, duplicates, reorders, delays and rate limits
+// them, the same link model tftp_sim uses, but on real sockets. Run it in
+// front of tftp_server or udp_server and point the client at it:
+//
+//     udp_proxy -l 5 -D 20000 -j 5000 127.0.0.1 8888    (listens on 9999)
+//     tftp_client 127.0.0.1 9999 ...
+//
+// Each client address gets its own upstream socket, so the server sees one
+// peer per client. A TFTP server answers from a new port (its TID): the
+// proxy mirrors that with a socket of its own facing the client, so the
+// client sees TIDs change just as it would without the proxy.
+//
+// Each direction draws from its own generator seeded with -S, so with the
+// same traffic a seed drops, duplicates and delays the same packets.
+
+#define LISTEN_PORT 9999
+#define SERVER_PORT 8888
+#define MAX_PACKET 65536
+#define PKT_OVERHEAD 28 // IPv4 + UDP headers
+#define MAX_EVENTS 64
+#define MAX_TIDS 8     // server ports a single client may talk to
+#define FLOW_BUCKETS 4096
+#define FLOW_IDLE_US 60000000 // a client silent this long is forgotten
+#define SWEEP_US 1000000
+
+#define TO_SERVER 0
+#define TO_CLIENT 1
+
+struct flow;
+
+// A socket the proxy receives on. The listening socket and each mirrored
+// TID face clients and relay to server; a flow's upstream socket faces the
+// server.
+typedef struct
+{
+    int fd;
+    struct flow *flow;         // NULL for the listening socket
+    struct sockaddr_in server; // client facing: where what arrives goes
+} endpoint_t;
+
+typedef struct flow
+{
+    struct sockaddr_in client;
+    endpoint_t up;
+    endpoint_t *tids[MAX_TIDS];
+    int ntids;
+    int inflight; // packets on the link to or from this client
+    long long last_seen;
+    struct flow *next; // hash chain
+} flow_t;
+
+// A packet on the link, waiting for its arrival time
+typedef struct
+{
+    flow_t *flow;
+    int fd;
+    struct sockaddr_in to;
+    unsigned char *data;
+    int len;
+} packet_t;
+
+typedef struct
+{
+    long long received;
+    long long delivered;
+    long long lost;
+    long long dropped; // tail drops of a full rate limit queue
+    long long duplicated;
+    long long reordered;
+} counters_t;
+
+static netsim_link_t net;
+static uint64_t rng_state[2]; // one stream per direction
+static netsim_dir_t dirs[2];
+static counters_t counters[2];
+
+static struct sockaddr_in listen_addr;
+static struct sockaddr_in target;
+static endpoint_t listener;
+static int epfd;
+static flow_t *flows[FLOW_BUCKETS];
+static int nflows;
+
+static netsim_heap_t heap;
+
+static volatile sig_atomic_t stop;
+
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int same_addr(struct sockaddr_in *a, struct sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static int udp_socket(struct sockaddr_in *bind_addr)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)bind_addr, sizeof(*bind_addr)) < 0)
+    {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int watch(endpoint_t *ep)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = ep;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, ep->fd, &ev) < 0)
+    {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+static unsigned flow_hash(struct sockaddr_in *addr)
+{
+    uint32_t h = addr->sin_addr.s_addr * 2654435761u ^ addr->sin_port * 40503u;
+    return (h ^ h >> 16) % FLOW_BUCKETS;
+}
+
+static flow_t *flow_find(struct sockaddr_in *client)
+{
+    for (flow_t *f = flows[flow_hash(client)]; f; f = f->next)
+    {
+        if (same_addr(&f->client, client))
+            return f;
+    }
+    return NULL;
+}
+
+static flow_t *flow_create(struct sockaddr_in *client)
+{
+    flow_t *f = calloc(1, sizeof(flow_t));
+    if (!f)
+    {
+        perror("calloc");
+        return NULL;
+    }
+
+    struct sockaddr_in any;
+    memset(&any, 0, sizeof(any));
+    any.sin_family = AF_INET;
+    f->up.fd = udp_socket(&any);
+    f->up.flow = f;
+    if (f->up.fd < 0 || watch(&f->up) < 0)
+    {
+        if (f->up.fd >= 0)
+            close(f->up.fd);
+        free(f);
+        return NULL;
+    }
+
+    f->client = *client;
+    unsigned b = flow_hash(client);
+    f->next = flows[b];
+    flows[b] = f;
+    nflows++;
+    return f;
+}
+
+static void flow_free(flow_t *f)
+{
+    close(f->up.fd);
+    for (int i = 0; i < f->ntids; i++)
+    {
+        close(f->tids[i]->fd);
+        free(f->tids[i]);
+    }
+    free(f);
+    nflows--;
+}
+
+// Socket facing the client for what server sends from a port other than
+// the one the proxy forwards to: a TID, which gets a port of our own
+static endpoint_t *flow_tid(flow_t *f, struct sockaddr_in *server)
+{
+    if (same_addr(server, &target))
+        return &listener;
+    for (int i = 0; i < f->ntids; i++)
+    {
+        if (same_addr(&f->tids[i]->server, server))
+            return f->tids[i];
+    }
+    if (f->ntids == MAX_TIDS)
+        return NULL;
+
+    endpoint_t *ep = malloc(sizeof(endpoint_t));
+    if (!ep)
+    {
+        perror("malloc");
+        return NULL;
+    }
+    struct sockaddr_in local = listen_addr;
+    local.sin_port = 0;
+    ep->fd = udp_socket(&local);
+    ep->flow = f;
+    ep->server = *server;
+    if (ep->fd < 0 || watch(ep) < 0)
+    {
+        if (ep->fd >= 0)
+            close(ep->fd);
+        free(ep);
+        return NULL;
+    }
+    f->tids[f->ntids++] = ep;
+    return ep;
+}
+
+// Puts a packet on the link in direction dir, through the impairments
+static void link_send(int dir, flow_t *f, int fd, struct sockaddr_in *to, unsigned char *data, int len, long long now)
+{
+    counters_t *c = &counters[dir];
+    c->received++;
+
+    long long at[2];
+    int reordered;
+    int copies = netsim_send(&net, &dirs[dir], len + PKT_OVERHEAD, now, at, &reordered);
+    if (copies == NETSIM_DROPPED)
+    {
+        c->dropped++;
+        return;
+    }
+    if (copies == 0)
+    {
+        c->lost++;
+        return;
+    }
+    c->duplicated += copies - 1;
+    c->reordered += reordered;
+    for (int i = 0; i < copies; i++)
+    {
+        unsigned char *copy = malloc(len);
+        if (!copy)
+        {
+            perror("malloc");
+            return;
+        }
+        memcpy(copy, data, len);
+        packet_t *p = netsim_heap_push(&heap, at[i]);
+        p->data = copy;
+        p->len = len;
+        p->flow = f;
+        p->fd = fd;
+        p->to = *to;
+        f->inflight++;
+    }
+}
+
+// Sends whatever has arrived at the far end of the link by now
+static void link_deliver(long long now)
+{
+    while (netsim_heap_next(&heap) >= 0 && netsim_heap_next(&heap) <= now)
+    {
+        packet_t p = *(packet_t *)netsim_heap_pop(&heap);
+        int dir = p.fd == p.flow->up.fd ? TO_SERVER : TO_CLIENT;
+        if (sendto(p.fd, p.data, p.len, 0, (struct sockaddr *)&p.to, sizeof(p.to)) == p.len)
+            counters[dir].delivered++;
+        p.flow->inflight--;
+        free(p.data);
+    }
+}
+
+// Datagrams from a client, to the listening socket or a mirrored TID
+static void on_client(endpoint_t *ep, unsigned char *buffer, long long now)
+{
+    while (1)
+    {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t n = recvfrom(ep->fd, buffer, MAX_PACKET, 0, (struct sockaddr *)&from, &from_len);
+        if (n < 0)
+            break;
+
+        flow_t *f = ep->flow;
+        if (!f)
+        {
+            f = flow_find(&from);
+            if (!f && !(f = flow_create(&from)))
+                continue;
+        }
+        else if (!same_addr(&from, &f->client))
+        {
+            continue; // a TID only relays for the client it was made for
+        }
+
+        f->last_seen = now;
+        link_send(TO_SERVER, f, f->up.fd, &ep->server, buffer, n, now);
+    }
+}
+
+// Datagrams from the server to a flow's upstream socket
+static void on_server(flow_t *f, unsigned char *buffer, long long now)
+{
+    while (1)
+    {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t n = recvfrom(f->up.fd, buffer, MAX_PACKET, 0, (struct sockaddr *)&from, &from_len);
+        if (n < 0)
+            break;
+
+        endpoint_t *ep = flow_tid(f, &from);
+        if (!ep)
+            continue;
+        f->last_seen = now;
+        link_send(TO_CLIENT, f, ep->fd, &f->client, buffer, n, now);
+    }
+}
+
+// Forgets clients that went quiet and have nothing left on the link
+static void sweep_flows(long long now)
+{
+    for (int b = 0; b < FLOW_BUCKETS; b++)
+    {
+        flow_t **prev = &flows[b];
+        while (*prev)
+        {
+            flow_t *f = *prev;
+            if (f->inflight == 0 && now - f->last_seen > FLOW_IDLE_US)
+            {
+                *prev = f->next;
+                flow_free(f);
+            }
+            else
+            {
+                prev = &f->next;
+            }
+        }
+    }
+}
+
+static void print_counters(void)
+{
+    static const char *names[2] = {"client->server", "server->client"};
+    for (int dir = 0; dir < 2; dir++)
+    {
+        counters_t *c = &counters[dir];
+        fprintf(stderr, "%s: %lld received, %lld delivered, %lld lost, %lld queue drops, %lld duplicated, %lld reordered\n",
+                names[dir], c->received, c->delivered, c->lost, c->dropped, c->duplicated, c->reordered);
+    }
+}
+
+static void handler(int signal)
+{
+    stop = 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-p port] [-l loss%%] [-d dup%%] [-o reorder%%] [-D delay_us] [-j jitter_us] [-R kB/s] [-Q bytes] [-S seed] <server_ip> [server_port]\n", prog);
+    fprintf(stderr, "  -p  port to listen on, on 127.0.0.1 (default %d)\n", LISTEN_PORT);
+    fprintf(stderr, "  -l  packets lost, each way (default 0)\n");
+    fprintf(stderr, "  -d  packets duplicated (default 0)\n");
+    fprintf(stderr, "  -o  packets reordered, held back behind later ones (default 0)\n");
+    fprintf(stderr, "  -D  one-way delay in microseconds (default 0)\n");
+    fprintf(stderr, "  -j  random extra delay, up to this many microseconds (default 0)\n");
+    fprintf(stderr, "  -R  link rate each way (default unlimited)\n");
+    fprintf(stderr, "  -Q  bytes queued behind the rate limit before packets are dropped (default unlimited)\n");
+    fprintf(stderr, "  -S  random seed; the same seed impairs the same packets (default 1)\n");
+    fprintf(stderr, "The server port defaults to %d. SIGINT or SIGTERM prints what was done to the traffic.\n", SERVER_PORT);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int port = LISTEN_PORT;
+    unsigned long long seed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:l:d:o:D:j:R:Q:S:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            port = atoi(optarg);
+            if (port < 1 || port > 65535)
+                usage(argv[0]);
+            break;
+        case 'l':
+            net.loss = atof(optarg) / 100;
+            break;
+        case 'd':
+            net.dup = atof(optarg) / 100;
+            break;
+        case 'o':
+            net.reorder = atof(optarg) / 100;
+            break;
+        case 'D':
+            net.delay = atoll(optarg);
+            if (net.delay < 0)
+                usage(argv[0]);
+            break;
+        case 'j':
+            net.jitter = atoll(optarg);
+            if (net.jitter < 0)
+                usage(argv[0]);
+            break;
+        case 'R':
+            net.rate = atoll(optarg) * 1000;
+            if (net.rate < 0)
+                usage(argv[0]);
+            break;
+        case 'Q':
+            net.queue = atoll(optarg);
+            if (net.queue < 0)
+                usage(argv[0]);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind < 1 || argc - optind > 2)
+        usage(argv[0]);
+
+    memset(&target, 0, sizeof(target));
+    target.sin_family = AF_INET;
+    target.sin_port = htons(argc - optind == 2 ? atoi(argv[optind + 1]) : SERVER_PORT);
+    if (inet_pton(AF_INET, argv[optind], &target.sin_addr) <= 0)
+    {
+        fprintf(stderr, "Invalid address %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Two streams from one seed, so the traffic one way does not shift the
+    // draws for the other
+    rng_state[TO_SERVER] = seed ? seed : 1;
+    rng_state[TO_CLIENT] = rng_state[TO_SERVER] ^ 0x9E3779B97F4A7C15ULL;
+    dirs[TO_SERVER].rng = &rng_state[TO_SERVER];
+    dirs[TO_CLIENT].rng = &rng_state[TO_CLIENT];
+    netsim_heap_init(&heap, sizeof(packet_t));
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handler;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGINT, &sa, NULL) < 0 || sigaction(SIGTERM, &sa, NULL) < 0)
+    {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&listen_addr, 0, sizeof(listen_addr));
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_port = htons(port);
+    listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    epfd = epoll_create1(0);
+    if (epfd < 0)
+    {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    listener.fd = udp_socket(&listen_addr);
+    listener.flow = NULL;
+    listener.server = target;
+    if (listener.fd < 0 || watch(&listener) < 0)
+        exit(EXIT_FAILURE);
+
+    printf("Relaying 127.0.0.1:%d to %s:%d\n", port, argv[optind], ntohs(target.sin_port));
+    fflush(stdout);
+
+    unsigned char *buffer = malloc(MAX_PACKET);
+    if (!buffer)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    long long next_sweep = now_us() + SWEEP_US;
+    while (!stop)
+    {
+        // Sleep until the next packet is due, rounding up to whole ms
+        int timeout = -1;
+        long long now = now_us();
+        long long next = netsim_heap_next(&heap);
+        if (next >= 0)
+            timeout = next > now ? (int)((next - now + 999) / 1000) : 0;
+        if (timeout < 0 || timeout > SWEEP_US / 1000)
+            timeout = SWEEP_US / 1000;
+
+        int nfds = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (nfds < 0 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        now = now_us();
+        for (int i = 0; i < nfds; i++)
+        {
+            endpoint_t *ep = events[i].data.ptr;
+            if (ep->flow && ep == &ep->flow->up)
+                on_server(ep->flow, buffer, now);
+            else
+                on_client(ep, buffer, now);
+        }
+
+        link_deliver(now_us());
+        if (now >= next_sweep)
+        {
+            sweep_flows(now);
+            next_sweep = now + SWEEP_US;
+        }
+    }
+
+    print_counters();
+    return 0;
+}